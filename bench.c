@@ -0,0 +1,352 @@
+/*--------------------------------------------------------------------
+ * Kujira: microbenchmarks for the pixel kernels
+ *
+ * Copyright 2020 Sean Tommasi
+ *--------------------------------------------------------------------*/
+#define KUJIRA_NO_MAIN
+#include "main.c"
+
+/* A benchmark's setup puts the world into the state the kernel needs
+ * and returns how many units (pixels, or calls for the kernels that
+ * aren't per-pixel) one run of the kernel processes. */
+typedef struct benchmark {
+    const char *name;
+    const char *unit;
+    double (*setup)();
+    void (*run)();
+} Benchmark;
+
+typedef struct benchResult {
+    const Benchmark *benchmark;
+    double units;
+    long iterations;
+    double mean;
+    double stddev;
+    double min;
+} BenchResult;
+
+Bitmap whale;
+Bitmap whaleMips[MIP_LEVELS];
+Bitmap screen;
+volatile unsigned int sink;
+
+/*--------------------------------------------------------------------
+ * makeWhale
+ *
+ * Stand-in for assets/whale.bmp when it isn't around: an opaque dark
+ * ellipse with a white eye on a transparent background.
+ *--------------------------------------------------------------------*/
+Bitmap makeWhale()
+{
+    Bitmap bitmap = newBitmap(64, 48, MEM_ASSETS);
+    for (int y = 0; y < bitmap.height; ++y) {
+        for (int x = 0; x < bitmap.width; ++x) {
+            float dx = (x - 32) / 28.0f;
+            float dy = (y - 24) / 16.0f;
+            unsigned int color = 0;
+            if (dx * dx + dy * dy <= 1.0f) {
+                color = 0x202040ff;
+                if ((x - 48) * (x - 48) + (y - 20) * (y - 20) < 6) {
+                    color = 0xffffffff;
+                }
+            }
+            bitmap.data[y * bitmap.stride + x] = color;
+        }
+    }
+    return bitmap;
+}
+
+/*--------------------------------------------------------------------
+ * Benchmarks
+ *--------------------------------------------------------------------*/
+double setupScreen()
+{
+    fillBitmap(&screen, 0xeb9b34ff);
+    return screen.width * screen.height;
+}
+
+void runApplyColor()
+{
+    for (int y = 0; y < screen.height; ++y) {
+        unsigned int *p = screen.data + y * screen.stride;
+        for (int x = 0; x < screen.width; ++x) {
+            applyColor(0x6f6fbf80, p + x);
+        }
+    }
+}
+
+void runFillBitmap()
+{
+    fillBitmap(&screen, 0xeb9b34ff);
+}
+
+/* Tile-sized opaque rectangles over the whole screen, as drawMap
+ * draws them */
+void runDrawRect()
+{
+    for (int y = 0; y < DISPLAY_PH; y += TILESIZE) {
+        for (int x = 0; x < DISPLAY_PW; x += TILESIZE) {
+            drawRect(screen, x, y, TILESIZE, TILESIZE, 0x4f4f9fff);
+        }
+    }
+}
+
+float benchScale;
+
+double setupScaleDown()
+{
+    benchScale = 0.6f;
+    return (int)(whale.width * benchScale) * (int)(whale.height * benchScale);
+}
+
+double setupScaleUp()
+{
+    benchScale = 2.5f;
+    return (int)(whale.width * benchScale) * (int)(whale.height * benchScale);
+}
+
+void runScaleBitmap()
+{
+    Bitmap scaled = scaleBitmap(whale, whaleMips, benchScale);
+    sink = scaled.data[0];
+    arenaReset(&frameArena);
+}
+
+double setupWhale()
+{
+    return whale.width * whale.height;
+}
+
+void runRotateBitmap()
+{
+    Bitmap rotated = rotateBitmap(whale, 0.7f);
+    sink = rotated.data[0];
+    arenaReset(&frameArena);
+}
+
+void runVflipBitmap()
+{
+    Bitmap flipped = vflipBitmap(whale);
+    sink = flipped.data[0];
+    arenaReset(&frameArena);
+}
+
+double setupDrawBitmap()
+{
+    memcpy(display.buffer, bgBufferNew.data,
+        display.strideY * display.height);
+    return 1;
+}
+
+/* Facing left and mid-hop, so the flip path runs too */
+void runDrawBitmap()
+{
+    drawBitmap(whale, DISPLAY_PW / 2, DISPLAY_PH / 2, M_PI, 1.2f);
+    arenaReset(&frameArena);
+}
+
+double setupBackgroundStatic()
+{
+    cam.tileX = cam.destTileX = 0;
+    cam.tileY = cam.destTileY = 0;
+    cam.pixelX = cam.pixelY = 0;
+    return display.width * display.height;
+}
+
+/* Halfway through a scroll to the right */
+double setupBackgroundScrolling()
+{
+    cam.tileX = 0;
+    cam.destTileX = SCROLL_TW;
+    cam.tileY = cam.destTileY = 0;
+    cam.pixelX = SCROLL_PW / 2;
+    cam.pixelY = 0;
+    return display.width * display.height;
+}
+
+void runDrawBackground()
+{
+    drawBackground();
+}
+
+double setupDrawMap()
+{
+    cam.tileX = cam.destTileX = 0;
+    cam.tileY = cam.destTileY = 0;
+    return 1;
+}
+
+void runDrawMap()
+{
+    drawMap();
+}
+
+/* A spread of coordinates around the start of the map, both on and off
+ * the tile path */
+double setupBorderCollide()
+{
+    return 1024;
+}
+
+void runBorderCollide()
+{
+    unsigned int hits = 0;
+    for (int i = 0; i < 1024; ++i) {
+        hits += borderCollide((i * 7) % 41 - 20, (i * 13) % 29 - 14);
+    }
+    sink = hits;
+}
+
+const Benchmark benchmarks[] = {
+    {"applyColor", "pixel", setupScreen, runApplyColor},
+    {"fillBitmap", "pixel", setupScreen, runFillBitmap},
+    {"drawRect", "pixel", setupScreen, runDrawRect},
+    {"scaleBitmap/down", "pixel", setupScaleDown, runScaleBitmap},
+    {"scaleBitmap/up", "pixel", setupScaleUp, runScaleBitmap},
+    {"rotateBitmap", "pixel", setupWhale, runRotateBitmap},
+    {"vflipBitmap", "pixel", setupWhale, runVflipBitmap},
+    {"drawBitmap", "call", setupDrawBitmap, runDrawBitmap},
+    {"drawBackground/static", "pixel", setupBackgroundStatic, runDrawBackground},
+    {"drawBackground/scrolling", "pixel", setupBackgroundScrolling, runDrawBackground},
+    {"drawMap", "call", setupDrawMap, runDrawMap},
+    {"borderCollide", "call", setupBorderCollide, runBorderCollide},
+};
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*--------------------------------------------------------------------
+ * runBenchmark
+ *
+ * Calibrate an iteration count that takes about a millisecond, then
+ * time the given number of samples of that many iterations. Results
+ * are in nanoseconds per run of the kernel.
+ *--------------------------------------------------------------------*/
+BenchResult runBenchmark(const Benchmark *benchmark, int samples)
+{
+    BenchResult result;
+    result.benchmark = benchmark;
+    result.units = benchmark->setup();
+    long iterations = 1;
+    for (;;) {
+        unsigned long long start = monotonicNs();
+        for (long i = 0; i < iterations; ++i) {
+            benchmark->run();
+        }
+        if (monotonicNs() - start >= 1000000 || iterations >= 1 << 24) {
+            break;
+        }
+        iterations *= 2;
+    }
+    result.iterations = iterations;
+    double sum = 0, sumSquares = 0;
+    result.min = 0;
+    for (int s = 0; s < samples; ++s) {
+        unsigned long long start = monotonicNs();
+        for (long i = 0; i < iterations; ++i) {
+            benchmark->run();
+        }
+        double ns = (monotonicNs() - start) / (double)iterations;
+        sum += ns;
+        sumSquares += ns * ns;
+        if (s == 0 || ns < result.min) {
+            result.min = ns;
+        }
+    }
+    result.mean = sum / samples;
+    double variance = sumSquares / samples - result.mean * result.mean;
+    result.stddev = variance > 0 ? sqrt(variance) : 0;
+    return result;
+}
+
+/*--------------------------------------------------------------------
+ * writeJson
+ *
+ * Write the results in a form that's easy to diff and track.
+ *--------------------------------------------------------------------*/
+void writeJson(FILE *fp, const BenchResult *results, int count, int samples)
+{
+    fprintf(fp, "{\n  \"samples\": %d,\n  \"benchmarks\": [\n", samples);
+    for (int i = 0; i < count; ++i) {
+        const BenchResult *r = &results[i];
+        fprintf(fp,
+            "    {\"name\": \"%s\", \"unit\": \"%s\", "
+            "\"units_per_op\": %.0f, \"iterations\": %ld, "
+            "\"ns_per_op\": %.3f, \"ns_per_op_stddev\": %.3f, "
+            "\"ns_per_op_min\": %.3f, \"ns_per_unit\": %.4f, "
+            "\"units_per_sec\": %.0f}%s\n",
+            r->benchmark->name, r->benchmark->unit, r->units, r->iterations,
+            r->mean, r->stddev, r->min, r->mean / r->units,
+            r->units / r->mean * 1e9, i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+/*--------------------------------------------------------------------
+ * main
+ *
+ * Set up a headless display, a map from a fixed seed, and the whale
+ * with its mips, then run every benchmark whose name contains the filter.
+ *--------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+    const char *filter = "";
+    const char *jsonFile = NULL;
+    int samples = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonFile = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else {
+            fprintf(stderr,
+                "usage: %s [--filter NAME] [--samples N] [--json FILE|-]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (samples < 2) {
+        samples = 2;
+    }
+    initMath();
+    srand(1);
+    initMap();
+    initDisplay(&headlessBackend);
+    initBackground();
+    drawMap();
+    whale = access("assets/whale.bmp", R_OK) == 0
+        ? loadBitmap("assets/whale.bmp") : makeWhale();
+    if (!whale.data) {
+        whale = makeWhale();
+    }
+    buildMips(whale, whaleMips, MEM_ASSETS);
+    screen = newBitmap(DISPLAY_PW, DISPLAY_PH, MEM_FRAMEBUFFERS);
+
+    BenchResult results[BENCHMARK_COUNT];
+    int count = 0;
+    FILE *out = jsonFile && strcmp(jsonFile, "-") == 0 ? stderr : stdout;
+    fprintf(out, "%-26s %12s %10s %8s %12s %14s\n",
+        "benchmark", "ns/op", "+/-", "unit", "ns/unit", "units/s");
+    for (int i = 0; i < BENCHMARK_COUNT; ++i) {
+        if (!strstr(benchmarks[i].name, filter)) {
+            continue;
+        }
+        BenchResult *r = &results[count++];
+        *r = runBenchmark(&benchmarks[i], samples);
+        fprintf(out, "%-26s %12.1f %9.1f%% %8s %12.4f %14.0f\n",
+            r->benchmark->name, r->mean, 100 * r->stddev / r->mean,
+            r->benchmark->unit, r->mean / r->units, r->units / r->mean * 1e9);
+    }
+    if (jsonFile) {
+        FILE *fp = strcmp(jsonFile, "-") == 0 ? stdout : fopen(jsonFile, "w");
+        if (!fp) {
+            perror(jsonFile);
+            return 1;
+        }
+        writeJson(fp, results, count, samples);
+        if (fp != stdout) {
+            fclose(fp);
+        }
+    }
+    return 0;
+}
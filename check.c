@@ -0,0 +1,181 @@
+/*--------------------------------------------------------------------
+ * Kujira: checks of the engine's rules that a replay doesn't reach
+ *
+ * Copyright 2020 Sean Tommasi
+ *--------------------------------------------------------------------*/
+#define KUJIRA_NO_MAIN
+#include "main.c"
+
+/* A check returns 1 if it passes, and says what went wrong if not */
+typedef struct check {
+    const char *name;
+    int (*run)();
+} Check;
+
+/*--------------------------------------------------------------------
+ * Checks
+ *--------------------------------------------------------------------*/
+
+/* From each of the four ways, turning to face east and to face west
+ * has to settle, at the longest steps the player and the middle tier
+ * of entities ever take */
+int checkTurnSettles()
+{
+    const float dts[] = {
+        1.0f / BASE_TICK_RATE,
+        LOD_MID_INTERVAL / BASE_TICK_RATE,
+        1.0f / MIN_TICK_RATE,
+        LOD_MID_INTERVAL / MIN_TICK_RATE
+    };
+    const float destAngles[] = {0.0f, M_PI};
+    for (int d = 0; d < (int)(sizeof(dts) / sizeof(dts[0])); ++d) {
+        for (int t = 0; t < 2; ++t) {
+            for (int from = 0; from < 4; ++from) {
+                float angle = stepAngles[from];
+                int steps = 0;
+                while (angle != destAngles[t] && steps < 1000) {
+                    angle = turnStep(angle, destAngles[t], dts[d]);
+                    ++steps;
+                }
+                if (angle != destAngles[t]) {
+                    fprintf(stderr, "from %.2f to %.2f at dt %.4f: "
+                        "still at %.2f\n", stepAngles[from], destAngles[t],
+                        dts[d], angle);
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * writeBmp
+ *
+ * Write a plain 24 bit BMP of the given size, all one gray, by way of
+ * a temporary file, so a watcher only ever sees it whole.
+ *--------------------------------------------------------------------*/
+int writeBmp(const char *path, int width, int height)
+{
+    char temp[RESOURCE_PATH_SIZE + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int rowSize = (width * 3 + 3) / 4 * 4;
+    BitmapHeader header;
+    memset(&header, 0, sizeof(header));
+    header.signature = 0x4d42;
+    header.dataoffset = sizeof(header);
+    header.filesize = sizeof(header) + rowSize * height;
+    header.infoheadersize = 40;
+    header.width = width;
+    header.height = height;
+    header.planes = 1;
+    header.bitsperpixel = 24;
+    header.compression = BI_RGB;
+    FILE *fp = fopen(temp, "wb");
+    if (!fp) {
+        perror(temp);
+        return 0;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    unsigned char row[256 * 3 + 4];
+    memset(row, 0x80, sizeof(row));
+    for (int y = 0; y < height; ++y) {
+        fwrite(row, 1, rowSize, fp);
+    }
+    fclose(fp);
+    return rename(temp, path) == 0;
+}
+
+/* Acquiring a bitmap loads it, releasing the last reference frees it
+ * and everything it had, acquiring it again loads it afresh, and a
+ * change to its file is reloaded and swapped in. Stopping leaves no
+ * asset memory behind. */
+int checkResourceLifetime()
+{
+    char dir[] = "/tmp/kujira-check-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 0;
+    }
+    char path[RESOURCE_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/sprite.bmp", dir);
+    size_t live = memStats.tags[MEM_ASSETS].live;
+    int ok = writeBmp(path, 16, 8) && startResources(1);
+    ResourceHandle handle = ok ? acquireBitmap(path) : 0;
+    if (!handle || !waitForResources()
+        || resourceAsset(handle)->bitmap.width != 16) {
+        fprintf(stderr, "first load failed\n");
+        ok = 0;
+    }
+    if (ok) {
+        releaseResource(handle);
+        const Resource *r = &resources.slots[handle - 1];
+        if (r->refs || r->state != RESOURCE_FREE
+            || resourceAsset(handle)->bitmap.data) {
+            fprintf(stderr, "release left the resource behind\n");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        writeBmp(path, 24, 8);
+        handle = acquireBitmap(path);
+        if (!handle || !waitForResources()
+            || resourceAsset(handle)->bitmap.width != 24) {
+            fprintf(stderr, "acquiring again didn't load afresh\n");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        writeBmp(path, 32, 8);
+        /* The loader hears about the change in its own time */
+        for (int i = 0; i < 200; ++i) {
+            swapResources();
+            if (resourceAsset(handle)->bitmap.width == 32) {
+                break;
+            }
+            usleep(10000);
+        }
+        if (resourceAsset(handle)->bitmap.width != 32) {
+            fprintf(stderr, "the change to the file wasn't reloaded\n");
+            ok = 0;
+        }
+    }
+    releaseResource(handle);
+    stopResources();
+    if (memStats.tags[MEM_ASSETS].live != live) {
+        fprintf(stderr, "%zu bytes of assets left after stopping\n",
+            memStats.tags[MEM_ASSETS].live - live);
+        ok = 0;
+    }
+    unlink(path);
+    rmdir(dir);
+    return ok;
+}
+
+const Check checks[] = {
+    {"turnSettles", checkTurnSettles},
+    {"resourceLifetime", checkResourceLifetime},
+};
+#define CHECK_COUNT (int)(sizeof(checks) / sizeof(checks[0]))
+
+/*--------------------------------------------------------------------
+ * main
+ *
+ * Run every check whose name contains the filter, and fail if any of
+ * them do.
+ *--------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+    const char *filter = argc > 1 ? argv[1] : "";
+    int failed = 0;
+    initMath();
+    for (int i = 0; i < CHECK_COUNT; ++i) {
+        if (!strstr(checks[i].name, filter)) {
+            continue;
+        }
+        int passed = checks[i].run();
+        printf("%-20s %s\n", checks[i].name, passed ? "ok" : "FAILED");
+        failed += !passed;
+    }
+    return failed != 0;
+}
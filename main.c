@@ -6,9 +6,20 @@
 #include <SDL2/SDL.h>
 #include <time.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
 
 #define TILESIZE 48
 #define DISPLAY_PW 960
@@ -22,13 +33,33 @@
 #define SCROLL_TH (DISPLAY_TH - 5)
 #define SCROLL_PW (SCROLL_TW * TILESIZE)
 #define SCROLL_PH (SCROLL_TH * TILESIZE)
+/* The acceleration to cover distance d from rest in time t is
+ * 2d / t^2. The player and entities hop a tile in 0.2 s, and the
+ * camera scrolls in 0.75 s. */
+#define HOP_ACCEL ((2 * TILESIZE) / (0.2 * 0.2))
+#define SCROLL_ACCEL_X ((2 * SCROLL_PW) / (0.75 * 0.75))
+#define SCROLL_ACCEL_Y ((2 * SCROLL_PH) / (0.75 * 0.75))
+#define PLAYER_MIN_SCALE 0.2f
+#define PLAYER_MAX_SCALE 4.0f
+/* The per-step amounts in the simulation (turning, ripples, and so on)
+ * were tuned at this rate, and are scaled to the actual step */
+#define BASE_TICK_RATE 60.0f
+/* Much slower and a step is long enough to carry a hop or a scroll
+ * well past its tile; much faster and a step is too short to measure */
+#define MIN_TICK_RATE 30.0f
+#define MAX_TICK_RATE 1000.0f
+#define DEFAULT_RENDER_RATE 60
+
+typedef struct backend Backend;
 
 typedef struct display {
+    const Backend *backend;
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
     int width, height;
     int strideX, strideY;
+    int refreshRate;
     unsigned char *buffer;
 } Display;
 
@@ -43,6 +74,124 @@ typedef struct input {
     int key_r;
 } Input;
 
+/* Names for the keys of the Input struct, as used in input scripts */
+typedef struct inputKey {
+    const char *name;
+    size_t offset;
+} InputKey;
+
+const InputKey inputKeys[] = {
+    {"up", offsetof(Input, key_up)},
+    {"down", offsetof(Input, key_down)},
+    {"left", offsetof(Input, key_left)},
+    {"right", offsetof(Input, key_right)},
+    {"z", offsetof(Input, key_z)},
+    {"x", offsetof(Input, key_x)},
+    {"q", offsetof(Input, key_q)},
+    {"r", offsetof(Input, key_r)},
+};
+#define INPUT_KEY_COUNT (int)(sizeof(inputKeys) / sizeof(inputKeys[0]))
+
+/* Key presses and releases are queued as they arrive, with the time
+ * they happened, and taken off the queue by the simulation, so that a
+ * tap shorter than a frame still reaches it. The queue has one
+ * producer (the backend) and one consumer (the simulation), and needs
+ * no lock between them. */
+#define INPUT_QUEUE_SIZE 256
+
+typedef struct inputEvent {
+    unsigned long long time;
+    int key;
+    int down;
+} InputEvent;
+
+typedef struct inputQueue {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    unsigned int dropped;
+} InputQueue;
+
+/* One line of an input script: hold these keys for this many frames */
+typedef struct scriptStep {
+    int frames;
+    Input input;
+} ScriptStep;
+
+typedef struct inputScript {
+    ScriptStep *steps;
+    int count;
+    int index;
+    int framesLeft;
+} InputScript;
+
+/* Recorded runs start with this header, followed by one packed input
+ * word per fixed simulation step, with bit k set if inputKeys[k] is
+ * held down. Version 1 recordings had a word per rendered frame, and
+ * would play back at the wrong rate, so they're not accepted. */
+#define REPLAY_MAGIC "KJRP"
+#define REPLAY_VERSION 2
+#pragma pack(push, 1)
+typedef struct replayHeader {
+    char magic[4];
+    short version;
+    unsigned int seed;
+    float dtFrame;
+} ReplayHeader;
+#pragma pack(pop)
+
+typedef struct replay {
+    FILE *recordFile;
+    unsigned short *frames;
+    long count;
+    long index;
+} Replay;
+
+/* A display backend supplies the platform half of the display: a way
+ * to set itself up, to sample the keyboard, to put the finished
+ * display buffer somewhere, and to sleep until something happens. */
+struct backend {
+    const char *name;
+    int (*init)();
+    void (*getInput)();
+    void (*blit)();
+    void (*wait)(int ms);
+};
+
+/* A benchmark scenario: a map size, and a driver that plays the game
+ * by filling in each frame's input (and, for the situations that are
+ * hard to reach by playing, poking the world directly). */
+typedef struct scenario {
+    const char *name;
+    int mapLength;
+    int fish;
+    void (*drive)(long frame, Input *input);
+} Scenario;
+
+typedef struct options {
+    int headless;
+    int uncapped;
+    int simOnly;
+    int noIdle;
+    int noReload;
+    int fish;
+    float tickRate;
+    int renderRate;
+    long frameLimit;
+    unsigned int seed;
+    int hasSeed;
+    const char *scriptFile;
+    const char *recordFile;
+    const char *replayFile;
+    const char *traceFile;
+    const char *benchScenario;
+    const char *benchJson;
+    const char *baselineFile;
+    long benchFrames;
+    float threshold;
+    double soakSeconds;
+} Options;
+
 typedef struct tile {
     int x, y;
     int flatCoord;
@@ -85,12 +234,182 @@ typedef struct windowsBMP {
     BitmapHeader header;
 } WindowsBMP;
 
+/* BitmapHeader.compression */
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+#define BI_BITFIELDS 3
+#define BI_ALPHABITFIELDS 6
+
+/* The engine's pixels are 0xRRGGBBAA with straight alpha, and a fully
+ * transparent pixel is always 0 */
+#define ENGINE_RMASK 0xff000000u
+#define ENGINE_GMASK 0x00ff0000u
+#define ENGINE_BMASK 0x0000ff00u
+#define ENGINE_AMASK 0x000000ffu
+
+/* A bitmap's rows start on BITMAP_ALIGN byte boundaries, so stride,
+ * the number of pixels from the start of one row to the next, is the
+ * width rounded up to a whole number of BITMAP_ALIGN blocks. The
+ * padding is never drawn. */
+#define BITMAP_ALIGN 64
+
 typedef struct bitmap {
     unsigned int *data;
     int width;
     int height;
+    int stride;
 } Bitmap;
 
+/* The four directions the player faces, in the order of the pose
+ * frames prerendered for them */
+#define POSE_COUNT 4
+const float poseAngles[POSE_COUNT] = {
+    0.0f, M_PI / 2.0f, M_PI, (3.0f * M_PI) / 2.0f
+};
+
+/* Levels in a sprite's mip chain, down to a sixteenth of its size */
+#define MIP_LEVELS 4
+
+/* An asset archive, made by the pack tool, is mapped into memory at
+ * startup, and bitmaps point straight into it. After the header comes
+ * a table of entries, then the pixel data, each image aligned and
+ * padded like any other bitmap, followed by its silhouette mask, one
+ * bit per pixel and rows padded to whole bytes. Each entry holds an
+ * image as it is, and the pose frames drawBitmap would render for it
+ * facing each way at a scale of 1. */
+#define ARCHIVE_MAGIC "KJPK"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_NAME_SIZE 32
+
+typedef struct archiveHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int count;
+    unsigned int reserved;
+} ArchiveHeader;
+
+typedef struct archiveImage {
+    unsigned int offset;
+    unsigned int maskOffset;
+    int width, height;
+    int stride;
+    /* Bounding box of the pixels that aren't transparent */
+    int boxX, boxY, boxW, boxH;
+} ArchiveImage;
+
+typedef struct archiveEntry {
+    char name[ARCHIVE_NAME_SIZE];
+    ArchiveImage image;
+    ArchiveImage poses[POSE_COUNT];
+} ArchiveEntry;
+
+typedef struct archive {
+    unsigned char *base;
+    size_t size;
+    const ArchiveHeader *header;
+    const ArchiveEntry *entries;
+} Archive;
+
+Archive archive;
+
+/* A loaded bitmap, and if it came from an archive, its pose frames,
+ * which are otherwise without data. Its mips, built when it's first
+ * packed into the atlas, halve it in each dimension level by level,
+ * for scaleBitmap to shrink from. */
+typedef struct asset {
+    Bitmap bitmap;
+    Bitmap poses[POSE_COUNT];
+    Bitmap mips[MIP_LEVELS];
+    /* The bitmap is its own allocation, rather than pointing into the
+     * archive or an atlas page */
+    int owned;
+} Asset;
+
+/* Assets are loaded once per path and shared through handles, each
+ * holding a reference. A loader thread does the loading, so that the
+ * main loop never waits on the disk, and with hot reloading on, it
+ * watches the directories the assets are in with inotify and loads
+ * any asset that changes again. A newly loaded asset waits until the
+ * main thread swaps it in between frames. */
+#define MAX_RESOURCES 32
+#define RESOURCE_PATH_SIZE 256
+
+/* Index of a resource plus one, so that 0 is no resource */
+typedef int ResourceHandle;
+
+enum resourceState {
+    RESOURCE_FREE,
+    RESOURCE_QUEUED,
+    RESOURCE_LOADING,
+    RESOURCE_READY
+};
+
+typedef struct resource {
+    char path[RESOURCE_PATH_SIZE];
+    int refs;
+    int state;
+    /* Bumped whenever the slot is reused, so the loader can tell that
+     * what it loaded is no longer wanted */
+    unsigned int serial;
+    int watch;
+    int loaded;
+    /* Only the main thread touches the current asset */
+    Asset current;
+    Asset pending;
+    int hasPending;
+} Resource;
+
+typedef struct resources {
+    Resource slots[MAX_RESOURCES];
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    pthread_t loader;
+    int started;
+    int stopping;
+    /* Written to wake the loader up */
+    int wakeFds[2];
+    int inotify;
+} Resources;
+
+Resources resources = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .loaded = PTHREAD_COND_INITIALIZER,
+    .inotify = -1
+};
+
+/* Once loaded, every asset's frames are copied into atlas pages, and
+ * its bitmaps become views of them, so that the sprites drawn each
+ * frame sit together in memory. Frames mapped from the archive stay
+ * where they are, so they're never copied and their pages are still
+ * shared with every other process that maps the archive. Pages are
+ * packed in shelves: frames go left to right, tallest first, along a
+ * shelf as tall as the first of them, and when a shelf is full the
+ * next starts below it. Each frame starts at an aligned column, so its
+ * rows are aligned like any other bitmap's. A page is only as tall as
+ * its shelves. */
+#define ATLAS_PAGE_WIDTH 1024
+#define ATLAS_PAGE_HEIGHT 1024
+#define ATLAS_MAX_FRAMES (MAX_RESOURCES * (1 + POSE_COUNT + MIP_LEVELS))
+/* Enough that every frame that fits a page at all gets one */
+#define ATLAS_MAX_PAGES ATLAS_MAX_FRAMES
+
+typedef struct atlasFrame {
+    Bitmap *bitmap;
+    Asset *asset;
+    /* A mip built for this packing, freed once it's copied */
+    int built;
+    int page;
+    int x, y;
+} AtlasFrame;
+
+typedef struct atlas {
+    Bitmap pages[ATLAS_MAX_PAGES];
+    int pageCount;
+} Atlas;
+
+Atlas atlas;
+
 typedef struct ripple {
     Bitmap bitmap;
     float radius;
@@ -108,7 +427,7 @@ typedef struct player {
     float pixelX, pixelY;
     float accelX, accelY;
     float velocityX, velocityY;
-    Bitmap bitmap;
+    ResourceHandle sprite;
     int newDirection, oldDirection;
     float angle;
     float destAngle;
@@ -116,961 +435,5215 @@ typedef struct player {
     float destScale;
 } Player;
 
-Camera cam;
-Player player;
+/* Where the camera and the player are drawn this frame: between their
+ * previous and current simulation states. Each position is a tile and
+ * a pixel offset from it, like the simulation's own. */
+typedef struct view {
+    int camTileX, camTileY;
+    float camPixelX, camPixelY;
+    int playerTileX, playerTileY;
+    float playerPixelX, playerPixelY;
+    float playerAngle;
+    float playerScale;
+} View;
+
+/* Entities are found by where they are through a uniform grid over
+ * the map, in cells of SPATIAL_CELL_TILES tiles square, hashed into a
+ * fixed number of buckets. The grid is rebuilt from scratch every
+ * step: each bucket's entities are a run of indices, and cellStart
+ * holds where each run starts, and one more for where the last ends. */
+#define SPATIAL_CELL_TILES 4
+/* Must be a power of two */
+#define SPATIAL_BUCKETS 4096
+/* The most entities a query from the game takes at once */
+#define SPATIAL_QUERY_MAX 1024
+
+typedef struct spatialGrid {
+    int *cellStart;
+    int *indices;
+    /* Each entity's bucket, while the grid is being built */
+    int *buckets;
+    int capacity;
+} SpatialGrid;
+
+/* Sprites are queued as they're drawn, then sorted and drawn together
+ * at the end of the frame. Layers are drawn bottom first. */
+enum spriteLayer {
+    SPRITE_LAYER_ENTITIES,
+    SPRITE_LAYER_PLAYER
+};
+
+/* Rows of the display drawn at a time */
+#define SPRITE_BAND_HEIGHT 64
+
+typedef struct spriteDraw {
+    const Asset *sprite;
+    int layer;
+    int page;
+    int order;
+    int x, y;
+    float angle, scale;
+    /* What's blitted, and where its top left corner goes */
+    Bitmap image;
+    int x1, y1;
+} SpriteDraw;
+
+typedef struct spriteBatch {
+    SpriteDraw *draws;
+    int count;
+    int capacity;
+} SpriteBatch;
+
+/* A sprite transformed one way, kept for the rest of the batch */
+typedef struct spriteTransform {
+    const unsigned int *source;
+    unsigned int angleBits, scaleBits;
+    Bitmap image;
+    int dx, dy;
+} SpriteTransform;
+
+/* Everything else that swims the paths, like the fish, is an entity.
+ * Entities move a tile at a time by the same rules as the player, but
+ * their state is kept as a structure of arrays, one array per field,
+ * so that each step of the update runs down one field of every entity
+ * at a time. The arrays share one allocation. */
+#define FISH_SCALE 0.5f
+/* Entities are updated this many at a time, an aligned block's worth */
+#define ENTITY_BLOCK (BITMAP_ALIGN / (int)sizeof(float))
+
+/* How often an entity is updated depends on how far it is from the
+ * camera. Near ones, on the display or close enough to scroll onto it,
+ * are updated every step. Those farther out are updated every
+ * LOD_MID_INTERVAL steps, by that many steps' worth of time, and past
+ * LOD_MID_TILES they're dormant and not updated at all. Every
+ * LOD_ASSIGN_STEPS steps the entities are rearranged in place, near
+ * ones first, then middle, then dormant. Each tier's range is
+ * rounded up to whole blocks, so a few entities from the next tier out
+ * may be updated more often than they need to be. The middle ones are
+ * updated a slice at a time, a different slice each step.
+ * LOD_ASSIGN_STEPS is a multiple of LOD_MID_INTERVAL, so entities only
+ * move between slices at the start of a round of them, and each
+ * middle one is updated exactly once a round. */
+#define LOD_NEAR_MARGIN SCROLL_TW
+#define LOD_MID_TILES 64
+#define LOD_MID_INTERVAL 4
+#define LOD_ASSIGN_STEPS 16
+
+enum lodTier {
+    LOD_NEAR,
+    LOD_MID,
+    LOD_DORMANT,
+    LOD_TIER_COUNT
+};
+
+typedef struct entities {
+    int count;
+    /* Where the near and middle tiers end */
+    int nearEnd, midEnd;
+    int tierCounts[LOD_TIER_COUNT];
+    void *block;
+    int *x, *y;
+    int *destX, *destY;
+    int *direction;
+    float *pixelX, *pixelY;
+    float *velocityX, *velocityY;
+    float *accelX, *accelY;
+    float *angle, *destAngle;
+    float *scale;
+    /* Room to rearrange the others by tier */
+    int *tier, *order;
+    unsigned int *scratch;
+    /* Drawn with one shared sprite, at this scale */
+    ResourceHandle sprite;
+    float spriteScale;
+    /* State of their own random numbers, so they don't use up the
+     * map generator's */
+    unsigned int random;
+} Entities;
+
+/* The simulation advances in fixed steps of dtFrame, at a tick rate
+ * that's independent of the frame rate. Each frame, the real time
+ * since the last frame is added to the accumulator, and whole steps
+ * are taken out of it. What's left over, as a fraction of a step, is
+ * how far to interpolate between the last two states. In lockstep mode
+ * (replays and headless runs) every frame is exactly one step, so runs
+ * are reproducible regardless of speed. */
+#define MAX_FRAME_SIM_TIME 0.1f
+
+typedef struct scheduler {
+    int lockstep;
+    unsigned long long lastTime;
+    float accumulator;
+    float alpha;
+    long droppedSteps;
+} Scheduler;
+
+/* Presented frames are paced to the display's refresh period. With
+ * vsync, SDL_RenderPresent does the waiting. Without it, the pacer
+ * sleeps until shortly before the deadline and spins the rest of the
+ * way, learning from each sleep how early it has to wake up. Either
+ * way it keeps statistics on how far frames land from the period. */
+typedef struct pacer {
+    int vsync;
+    unsigned long long period;
+    unsigned long long deadline;
+    unsigned long long margin;
+    float oversleep;
+    unsigned long long lastFrame;
+    long frames;
+    long missed;
+    double errorSum;
+    double errorSquares;
+    double errorMax;
+} Pacer;
+
+/* Longest the loop blocks while idle, so it still comes round now and
+ * then without any events */
+#define IDLE_TIMEOUT_MS 250
+
+/* When nothing in the world moved on the last step and nothing is
+ * held down, the frame on screen is already right. Once one such
+ * frame has been drawn, the loop stops rendering and presenting, and
+ * blocks on the backend until there's an event. */
+typedef struct idle {
+    int enabled;
+    int resting;
+    long skipped;
+    long waits;
+} Idle;
+
+Camera cam, prevCam;
+Player player, prevPlayer;
+View view;
+Entities entities;
+SpriteBatch spriteBatch;
+SpatialGrid spatialGrid;
+Scheduler scheduler;
+Pacer pacer;
+Idle idle;
 int running = 1;
 float dtFrame;
-WindowsBMP playerBitmap;
 Bitmap bgBufferOld;
 Bitmap bgBufferNew;
 
-Tile tileArray[MAPLENGTH];
+/* The map is MAPLENGTH tiles unless a benchmark asks for another size */
+Tile *tileArray;
+int mapLength = MAPLENGTH;
 
 Display display;
 Input newInput, oldInput;
+InputQueue inputQueue;
+/* The keys held down, as of the last event the simulation took */
+Input heldInput;
+InputScript inputScript;
+Replay replay;
+const Scenario *scenario;
+Options options;
+long frameCount;
+long stepCount;
+
+/* Sines of a whole turn at TRIG_TABLE_SIZE points, plus the first
+ * again, so interpolating never wraps. Its resolution can be set at
+ * build time; the default is within a few parts in 10^7. */
+#ifndef TRIG_TABLE_BITS
+#define TRIG_TABLE_BITS 12
+#endif
+#define TRIG_TABLE_SIZE (1 << TRIG_TABLE_BITS)
+
+float sinTable[TRIG_TABLE_SIZE + 1];
 
 /*--------------------------------------------------------------------
- * tileCompare
+ * fastFloor, fastCeil, fastRound
  *
- * For the bsearch routine to find a tile by its flattened coordinate
- * number. Returns 0 if equal.
+ * Float to int conversions that truncate and correct, rather than
+ * going through libm. They're exact for anything that fits in an int.
+ * fastRound rounds halves up, which for the non-negative values it's
+ * used on is what round does.
  *--------------------------------------------------------------------*/
-int tileCompare(const void *a, const void *b)
+int fastFloor(float x)
 {
-    return ((Tile *)a)->flatCoord - ((Tile *)b)->flatCoord;
+    int i = (int)x;
+    return i - (x < (float)i);
+}
+
+int fastCeil(float x)
+{
+    int i = (int)x;
+    return i + (x > (float)i);
+}
+
+int fastRound(float x)
+{
+    return fastFloor(x + 0.5f);
 }
 
 /*--------------------------------------------------------------------
- * borderCollide
+ * initMath
  *
- * Return 0 for "no collide" if there is a tile at the given x and y
- * coordinates. Return 1 for "collide" if there is no tile.
+ * Fill in the sine table. Everything that uses fastSin or fastCos
+ * runs after this.
  *--------------------------------------------------------------------*/
-int borderCollide(int x, int y)
+void initMath()
 {
-    Tile tile;
-    tile.x = x;
-    tile.y = y;
-    tile.flatCoord = (tile.y * MAPWIDTH) + tile.x;
-    if (bsearch(&tile, tileArray, MAPLENGTH, sizeof(Tile), tileCompare)) {
-        return 0;
+    for (int i = 0; i <= TRIG_TABLE_SIZE; ++i) {
+        sinTable[i] = sin(2.0 * M_PI * i / TRIG_TABLE_SIZE);
     }
-    return 1;
 }
 
 /*--------------------------------------------------------------------
- * applyColor
+ * tableSin, fastSin, fastCos
  *
- * Blend the src color with whatever color is already at *dest, in
- * accordance with the former's alpha channel.
+ * Sine and cosine of any angle, in turns for tableSin and radians for
+ * the others, interpolated from the table. Cosine is sine a quarter
+ * turn on.
  *--------------------------------------------------------------------*/
-void applyColor(unsigned int src, unsigned int *dest)
+float tableSin(float turns)
 {
-    /* Linear blend:
-     *
-     * C = A + t(B - A)
-     *   = A + tB - tA
-     *   = A - tA + tB
-     * C = (1 - t)A + tB
-     *
-     * The first ordering of the equation says that the resulting color
-     * is some portion t, the alpha channel, of the distance between A
-     * and B, i.e. the destination and source pixels. The final
-     * reordering of this equation says that the resulting color is the
-     * alpha portion of B, plus a portion of A equal to the sacrificed
-     * portion of B. */
-    float a = (src & 0xFF) / 255.0f;
-    int r = ((1 - a) * (*dest >> 24 & 0xFF)) + (a * (src >> 24 & 0xFF));
-    int g = ((1 - a) * (*dest >> 16 & 0xFF)) + (a * (src >> 16 & 0xFF));
-    int b = ((1 - a) * (*dest >> 8 & 0xFF)) + (a * (src >> 8 & 0xFF));
-    *dest = r << 24 | g << 16 | b << 8 | (src & 0xFF);
+    float t = turns * TRIG_TABLE_SIZE;
+    int i = fastFloor(t);
+    float f = t - (float)i;
+    i &= TRIG_TABLE_SIZE - 1;
+    return sinTable[i] + (sinTable[i + 1] - sinTable[i]) * f;
 }
 
-/*--------------------------------------------------------------------
- * loadBitmap
- *
- * Open a Windows BMP file, extract its header information, read its
- * data, and finally load the data into another buffer, beginning with
- * the last row and moving upward in order to correct for the fact
- * that Windows BMPs are upside down.
- *--------------------------------------------------------------------*/
-Bitmap loadBitmap(const char *filename)
+float fastSin(float angle)
 {
-    FILE *fp;
-    WindowsBMP bmp;
-    Bitmap bitmap;
-    fp = fopen(filename, "r");
-    fseek(fp, 0, SEEK_END);
-    int n = ftell(fp);
-    rewind(fp);
-    bmp.data = (char *)malloc(n);
-    fread(bmp.data, 1, n, fp);
-    bmp.header = *(BitmapHeader *)bmp.data;
-    bmp.data += bmp.header.dataoffset;
-    int dataLen = bmp.header.width * bmp.header.height;
-    bitmap.data = (unsigned int *)malloc(dataLen * sizeof(int));
-    unsigned int *p = (unsigned int *)bmp.data + (bmp.header.width * (bmp.header.height - 1));
-    bitmap.width = bmp.header.width;
-    bitmap.height = bmp.header.height;
-    for (int y = 0; y < bitmap.height; ++y) {
-        for (int x = 0; x < bitmap.width; ++x) {
-            unsigned int *dest = bitmap.data + (y * bitmap.width) + x;
-            *dest = *(p - (y * bitmap.width) + x);
-        }
-    }
-    return bitmap;
+    return tableSin(angle * (float)(0.5 / M_PI));
+}
+
+float fastCos(float angle)
+{
+    return tableSin(angle * (float)(0.5 / M_PI) + 0.25f);
 }
 
+/* Heap memory is counted by the subsystem it belongs to */
+enum memTag {
+    MEM_ASSETS,
+    MEM_RIPPLES,
+    MEM_SPRITES,
+    MEM_MAP,
+    MEM_FRAMEBUFFERS,
+    MEM_ENTITIES,
+    MEM_INPUT,
+    MEM_OTHER,
+    MEM_TAG_COUNT
+};
+
+const char *memTagNames[MEM_TAG_COUNT] = {
+    "assets", "ripples", "sprites", "map", "framebuffers", "entities",
+    "input", "other"
+};
+const char *memTagCounters[MEM_TAG_COUNT] = {
+    "live bytes (assets)", "live bytes (ripples)", "live bytes (sprites)",
+    "live bytes (map)", "live bytes (framebuffers)", "live bytes (entities)",
+    "live bytes (input)", "live bytes (other)"
+};
+
+typedef struct memTagStats {
+    size_t live;
+    size_t peak;
+    unsigned long allocs;
+    unsigned long frees;
+} MemTagStats;
+
+typedef struct memStats {
+    unsigned long allocs;
+    unsigned long frees;
+    size_t live;
+    size_t peak;
+    MemTagStats tags[MEM_TAG_COUNT];
+} MemStats;
+
+MemStats memStats;
+/* The resource loader allocates too */
+pthread_mutex_t memLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every allocation is preceded by one of these, so that memFree knows
+ * what it's giving back */
+typedef struct memHeader {
+    void *base;
+    size_t size;
+    int tag;
+} MemHeader;
+
+#define MEM_ALIGN 16
+
 /*--------------------------------------------------------------------
- * vflipBitmap
+ * memAlloc, memAllocAligned, memFree
  *
- * Return a vertically flipped bitmap.
+ * All of the game's own heap memory goes through these, so that it
+ * can be counted, in allocations and in bytes, against the subsystem
+ * it's tagged with. memAlloc and memAllocAligned return zeroed memory.
  *--------------------------------------------------------------------*/
-Bitmap vflipBitmap(Bitmap bitmap)
+void *memAllocAligned(size_t size, size_t align, int tag)
 {
-    int w = bitmap.width;
-    int h = bitmap.height;
-    Bitmap vflippedBitmap;
-    vflippedBitmap.data = (unsigned int *)calloc(w * h, sizeof(int));
-    vflippedBitmap.width = w;
-    vflippedBitmap.height = h;
-    unsigned int *dest = vflippedBitmap.data;
-    dest += (w * h) - w;
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            *dest++ = *(bitmap.data + (y * w) + x);
-        }
-        dest -= w * 2;
+    if (align < MEM_ALIGN) {
+        align = MEM_ALIGN;
     }
-    return vflippedBitmap;
+    /* The header goes in the last bytes of the padding in front of
+     * the memory, a whole number of aligned blocks big enough for it,
+     * which keeps the memory itself aligned */
+    size_t padding = (sizeof(MemHeader) + align - 1) & ~(align - 1);
+    size_t total = (padding + size + align - 1) & ~(align - 1);
+    unsigned char *base = aligned_alloc(align, total);
+    if (!base) {
+        return NULL;
+    }
+    unsigned char *p = base + padding;
+    memset(p, 0, size);
+    MemHeader *header = (MemHeader *)p - 1;
+    header->base = base;
+    header->size = size;
+    header->tag = tag;
+    pthread_mutex_lock(&memLock);
+    MemTagStats *stats = &memStats.tags[tag];
+    ++stats->allocs;
+    stats->live += size;
+    if (stats->live > stats->peak) {
+        stats->peak = stats->live;
+    }
+    ++memStats.allocs;
+    memStats.live += size;
+    if (memStats.live > memStats.peak) {
+        memStats.peak = memStats.live;
+    }
+    pthread_mutex_unlock(&memLock);
+    return p;
 }
 
-/*--------------------------------------------------------------------
- * rotateBitmap
- *
- * Return a bitmap rotated to any angle expressed in radians.
- *--------------------------------------------------------------------*/
-Bitmap rotateBitmap(Bitmap bitmap, float angle)
+void *memAlloc(size_t size, int tag)
 {
-    int w = bitmap.width;
-    int h = bitmap.height;
-    Bitmap rotatedBitmap;
-    rotatedBitmap.data = (unsigned int *)calloc(w * h, sizeof(int));
-    rotatedBitmap.width = w;
-    rotatedBitmap.height = h;
-    float angleSin = sin(angle);
-    float angleCos = cos(angle);
-    float cx = w / 2;
-    float cy = h / 2;
-    unsigned int *dest = rotatedBitmap.data;
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            /* Get the rotated coordinates */
-            float rx = (((float)x - cx) * angleCos - ((float)y - cx) * angleSin) + cx;
-            float ry = (((float)x - cx) * angleSin + ((float)y - cy) * angleCos) + cy;
-            if (rx < 0 || ry < 0 || rx >= w - 1 || ry >= h - 1) {
-                continue;
-            }
-            /* Bilinear blending to smooth out edges */
-            unsigned int tl = *(bitmap.data + ((int)floor(ry) * w) + (int)floor(rx));
-            unsigned int tr = *(bitmap.data + ((int)floor(ry) * w) + (int)ceil(rx));
-            unsigned int bl = *(bitmap.data + ((int)ceil(ry) * w) + (int)floor(rx));
-            unsigned int br = *(bitmap.data + ((int)ceil(ry) * w) + (int)ceil(rx));
-            float dx = rx - floor(rx);
-            float dy = ry - floor(ry);
-            float topA = (1 - dx) * (tl >> 24 & 255) + dx * (tr >> 24 & 255);
-            float topR = (1 - dx) * (tl >> 16 & 255) + dx * (tr >> 16 & 255);
-            float topG = (1 - dx) * (tl >> 8 & 255) + dx * (tr >> 8 & 255);
-            float topB = (1 - dx) * (tl >> 0 & 255) + dx * (tr >> 0 & 255);
-            float botA = (1 - dx) * (bl >> 24 & 255) + dx * (br >> 24 & 255);
-            float botR = (1 - dx) * (bl >> 16 & 255) + dx * (br >> 16 & 255);
-            float botG = (1 - dx) * (bl >> 8 & 255) + dx * (br >> 8 & 255);
-            float botB = (1 - dx) * (bl >> 0 & 255) + dx * (br >> 0 & 255);
-            float a = (1 - dy) * topA + dy * botA;
-            float r = (1 - dy) * topR + dy * botR;
-            float g = (1 - dy) * topG + dy * botG;
-            float b = (1 - dy) * topB + dy * botB;
-            unsigned int color = 0;
-            color |= (int)round(r) << 24;
-            color |= (int)round(g) << 16;
-            color |= (int)round(b) << 8;
-            color |= (int)round(a) << 0;
-            applyColor(color, dest + x);
-        }
-        dest += w;
+    return memAllocAligned(size, MEM_ALIGN, tag);
+}
+
+void memFree(void *p)
+{
+    if (p) {
+        MemHeader *header = (MemHeader *)p - 1;
+        pthread_mutex_lock(&memLock);
+        MemTagStats *stats = &memStats.tags[header->tag];
+        ++stats->frees;
+        stats->live -= header->size;
+        ++memStats.frees;
+        memStats.live -= header->size;
+        pthread_mutex_unlock(&memLock);
+        free(header->base);
     }
-    return rotatedBitmap;
 }
 
+/* Memory for things that only last until the end of the frame, like
+ * the scaled and rotated copies of a sprite. Allocation just bumps a
+ * pointer, and the whole arena is reset at the top of every frame. A
+ * frame that needs more than the arena has gets the rest from the
+ * heap, and the arena grows to fit at the next reset, so frames after
+ * that make no heap calls at all. */
+#define FRAME_ARENA_SIZE (1 << 20)
+#define ARENA_ALIGN BITMAP_ALIGN
+
+typedef struct arenaBlock {
+    struct arenaBlock *next;
+} ArenaBlock;
+
+typedef struct arena {
+    int tag;
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t needed;
+    size_t peak;
+    ArenaBlock *overflow;
+} Arena;
+
+Arena frameArena = {.tag = MEM_SPRITES};
+
 /*--------------------------------------------------------------------
- * scaleBitmap
+ * arenaAlloc
  *
- * Return a bitmap scaled to any real number.
+ * Return zeroed, aligned memory that lasts until the arena is reset.
  *--------------------------------------------------------------------*/
-Bitmap scaleBitmap(Bitmap bitmap, float scale)
+void *arenaAlloc(Arena *arena, size_t size)
 {
-    /* Original dimensions */
-    int w = bitmap.width;
-    int h = bitmap.height;
-    /* Scaled dimensions */
-    float wScaled = (float)w * scale;
-    float hScaled = (float)h * scale;
-    /* Ratio by which the original bitmap is scaled up or down */
-    float wRatio = (float)w / wScaled;
-    float hRatio = (float)h / hScaled;
-    Bitmap scaledBitmap;
-    scaledBitmap.data = (unsigned int *)calloc((int)(wScaled * hScaled), sizeof(int));
-    scaledBitmap.width = (int)(wScaled);
-    scaledBitmap.height = (int)(hScaled);
-    unsigned int *dest = scaledBitmap.data;
-    /* Move pixel by pixel through the new scaled bitmap, but multiply
-     * the movement by the ratios so that we either repeat or skip
-     * pixels depending on if we're scaling up or down. */
-    for (int y = 0; y < scaledBitmap.height; ++y) {
-        int yStride = (int)(y * hRatio) * bitmap.width;
-        for (int x = 0; x < scaledBitmap.width; ++x) {
-            unsigned int *src = bitmap.data + yStride + (int)(x * wRatio);
-            *(dest + x) = *src;
-        }
-        dest += scaledBitmap.width;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->needed += size;
+    if (arena->used + size <= arena->size) {
+        void *p = arena->base + arena->used;
+        arena->used += size;
+        memset(p, 0, size);
+        return p;
     }
-    return scaledBitmap;
+    /* The header is padded so the memory after it stays aligned */
+    size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1)
+        & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *block = memAllocAligned(header + size, ARENA_ALIGN, arena->tag);
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return (unsigned char *)block + header;
 }
 
 /*--------------------------------------------------------------------
- * drawBitmap
+ * arenaReset
  *
- * Copy an RGBA bitmap, rotated and scaled as needed, to the game's
- * primary display buffer.
- * TODO: This function is particularly designed for the main player,
- * currently the only sprite in the game. It will need to be
- * generalized at some point.
+ * Free everything allocated from the arena since the last reset, and
+ * if that didn't fit, grow the arena so that it would have.
  *--------------------------------------------------------------------*/
-void drawBitmap(Bitmap bitmap, int x, int y, float angle, float scale)
+void arenaReset(Arena *arena)
 {
-    Bitmap scaledBitmap = scaleBitmap(bitmap, scale);
-    int x1 = x + (bitmap.width - scaledBitmap.width) / 2;
-    int y1 = y + (bitmap.height - scaledBitmap.height) / 2;
-    int x2 = x1 + scaledBitmap.width;
-    int y2 = y1 + scaledBitmap.height;
-    int xoff = 0, yoff = 0;
-    if (x1 < 0) {
-        xoff = -x1;
-        x1 = 0;
+    while (arena->overflow) {
+        ArenaBlock *next = arena->overflow->next;
+        memFree(arena->overflow);
+        arena->overflow = next;
     }
-    if (y1 < 0) {
-        yoff = -y1;
-        y1 = 0;
-    }
-    if (x2 > display.width) {
-        x2 = display.width;
-    }
-    if (y2 > display.height) {
-        y2 = display.height;
-    }
-    Bitmap rotatedBitmap = rotateBitmap(scaledBitmap, angle);
-    if (fabs(angle - M_PI) < 0.1f) {
-        rotatedBitmap = vflipBitmap(rotatedBitmap);
+    if (arena->needed > arena->peak) {
+        arena->peak = arena->needed;
     }
-    unsigned int *src = rotatedBitmap.data + (yoff * rotatedBitmap.width) + xoff;
-    unsigned int *dest = (unsigned int *)display.buffer + (y1 * display.width);
-    for (int y = y1; y < y2; ++y) {
-        for (int x = x1; x < x2; ++x) {
-            unsigned int color = *(src + (x - x1));
-            if (color != 0xffffffff && color != 0) {
-                color = 0x000000ff;
-            }
-            applyColor(color, dest + x);
+    if (arena->needed > arena->size || !arena->base) {
+        size_t size = arena->size ? arena->size : FRAME_ARENA_SIZE;
+        while (size < arena->needed) {
+            size *= 2;
         }
-        src += rotatedBitmap.width;
-        dest += display.width;
+        memFree(arena->base);
+        arena->base = memAllocAligned(size, ARENA_ALIGN, arena->tag);
+        arena->size = size;
     }
-    free(rotatedBitmap.data);
-    free(scaledBitmap.data);
+    arena->used = 0;
+    arena->needed = 0;
 }
 
 /*--------------------------------------------------------------------
- * initRipple
+ * bitmapStride, newBitmap, frameBitmap, subBitmap
  *
- * Initialize a ripple struct at a given location in an array.
+ * Every bitmap is allocated through these, with aligned, padded rows:
+ * newBitmap's from the heap, and frameBitmap's from the frame arena.
+ * subBitmap makes a view of a rectangle of another bitmap, sharing its
+ * pixels and stride.
  *--------------------------------------------------------------------*/
-void initRipple(int x, int y)
+int bitmapStride(int width)
 {
-    /* Wrap around the array and overwrite */
-    if (rippleIndex > 4) {
-        rippleIndex = 0;
-    }
-    Ripple *ripple = &rippleArray[rippleIndex];
-    ripple->bitmap.width = 100;
-    ripple->bitmap.height = 100;
-    ripple->bitmap.data = (unsigned int *)calloc(ripple->bitmap.width * ripple->bitmap.height, sizeof(int));
-    ripple->radius = 20.0f;
-    ripple->alpha = 1.0f;
-    ripple->tileX = x;
-    ripple->tileY = y;
-    ripple->active = 1;
-    ++rippleIndex;
+    int perBlock = BITMAP_ALIGN / sizeof(int);
+    return (width + perBlock - 1) / perBlock * perBlock;
 }
 
-/*--------------------------------------------------------------------
- * fillBitmap
- *
- * Fill a bitmap buffer with a given color.
- *--------------------------------------------------------------------*/
-void fillBitmap(Bitmap *bitmap, int color)
+Bitmap newBitmap(int width, int height, int tag)
 {
-    for (int y = 0; y < bitmap->height; ++y) {
-        for (int x = 0; x < bitmap->width; ++x) {
-            *(bitmap->data + (y * bitmap->width) + x) = color;
-        }
-    }
+    Bitmap bitmap;
+    bitmap.width = width;
+    bitmap.height = height;
+    bitmap.stride = bitmapStride(width);
+    bitmap.data = memAllocAligned(
+        bitmap.stride * height * sizeof(int), BITMAP_ALIGN, tag);
+    return bitmap;
+}
+
+Bitmap frameBitmap(int width, int height)
+{
+    Bitmap bitmap;
+    bitmap.width = width;
+    bitmap.height = height;
+    bitmap.stride = bitmapStride(width);
+    bitmap.data = arenaAlloc(&frameArena, bitmap.stride * height * sizeof(int));
+    return bitmap;
+}
+
+Bitmap subBitmap(Bitmap bitmap, int x, int y, int width, int height)
+{
+    Bitmap view = bitmap;
+    view.data += y * bitmap.stride + x;
+    view.width = width;
+    view.height = height;
+    return view;
 }
 
 /*--------------------------------------------------------------------
- * animateRipple
+ * Profiler
  *
- * Draw a series of continuously expanding ripples, if they exist.
+ * Instrumented builds (-DKUJIRA_PROFILE) time each stage of the frame.
+ * PROFILE_BEGIN and PROFILE_END push timestamped marks into a
+ * lock-free single-producer ring, and profileEndFrame drains the ring
+ * once per frame into a rolling histogram per stage, from which the
+ * overlay and the exit report read p50, p99, and max. The same marks
+ * can also be written out as a Chrome trace. Without KUJIRA_PROFILE
+ * all of this compiles away.
  *--------------------------------------------------------------------*/
-void animateRipple()
-{
-    /* Iterate through the 4 ripples that can exist at a time */
-    for (int i = 0; i < 5; ++i) {
-        Ripple *ripple = &rippleArray[i];
-        /* Ripples are marked inactive at a certain radial limit */
-        if (!ripple->active) {
-            continue;
-        }
-        /* Clear the whole bitmap with full alpha transparency */
-        fillBitmap(&ripple->bitmap, 0);
-        /* Center point of the ripple circle */
-        float cx = ripple->bitmap.width / 2;
-        float cy = ripple->bitmap.height / 2;
-        /* Location of ripple on the screen */
-        int screenX = (ripple->tileX - cam.tileX + (DISPLAY_TW / 2)) * TILESIZE;
-        screenX -= cx;
-        screenX += TILESIZE / 2;
-        screenX -= cam.pixelX;
-        int screenY = (ripple->tileY - cam.tileY + (DISPLAY_TH / 2)) * TILESIZE;
-        screenY -= cy;
-        screenY += TILESIZE / 2;
-        screenY -= cam.pixelY;
-        /* Expands each frame */
-        ripple->radius += 1.0f;
-        /* Fades each frame */
-        ripple->alpha -= 0.03f;
-        /* For the gradient within the ripple */
-        float subAlpha = 1.0f;
-        /* Each ripple consists of 4.0 * 2 circles */
-        for (float rippleLine = 0.0f; rippleLine < 4.0f; rippleLine += 1.0f) {
-            /* Gradient within ripple */
-            unsigned int color = 0x6f6fbf << 8;
-            color |= (int)((ripple->alpha * 255) * subAlpha);
-            subAlpha -= 0.2f;
-            /* Inner and outer circle for bidirectional gradient */
-            for (float angle = 0.0f; angle < 2 * M_PI; angle += 0.01f) {
-                unsigned int *pixel;
-                float x, y;
-                x = cx + ((ripple->radius + rippleLine) * cos(angle));
-                y = cy + ((ripple->radius + rippleLine) * sin(angle));
-                pixel = ripple->bitmap.data;
-                pixel += ((int)y * ripple->bitmap.width) + (int)x;
-                *pixel = color;
-                x = cx + ((ripple->radius - rippleLine) * cos(angle));
-                y = cy + ((ripple->radius - rippleLine) * sin(angle));
-                pixel = ripple->bitmap.data;
-                pixel += ((int)y * ripple->bitmap.width) + (int)x;
-                *pixel = color;
-            }
-        }
-        /* Draw the ripple bitmap onto the game's display */
-        unsigned int *src = ripple->bitmap.data;
-        unsigned int *dest = (unsigned int *)display.buffer;
-        dest += (screenY * display.width) + screenX;
-        for (int y = 0; y < ripple->bitmap.height; ++y) {
-            for (int x = 0; x < ripple->bitmap.width; ++x) {
-                if (*(dest + x) != 0xeb9b34ff && *(dest + x) != 0x000000ff) {
-                    applyColor(*src, dest + x);
-                }
-                ++src;
-            }
-            dest += display.width;
-        }
-        /* Kill the ripple if it gets too big */
-        if (ripple->radius >= (ripple->bitmap.width - 5) / 2) {
-            ripple->active = 0;
-            free(ripple->bitmap.data);
+#ifdef KUJIRA_PROFILE
+enum {
+    STAGE_FRAME,
+    STAGE_GET_INPUT,
+    STAGE_UPDATE_PLAYER,
+    STAGE_UPDATE_CAMERA,
+    STAGE_UPDATE_ENTITIES,
+    STAGE_DRAW_MAP,
+    STAGE_DRAW_BACKGROUND,
+    STAGE_ANIMATE_RIPPLE,
+    STAGE_DRAW_ENTITIES,
+    STAGE_DRAW_PLAYER,
+    STAGE_DRAW_SPRITES,
+    STAGE_BLIT_DISPLAY,
+    STAGE_COUNT
+};
+
+/* Short names for the overlay, and span names for traces */
+const char *stageNames[STAGE_COUNT] = {
+    "FRAME", "GETINPUT", "PLAYER", "CAMERA", "ENTITIES", "DRAWMAP",
+    "BKGND", "RIPPLE", "DRAWENTS", "DRAWPLYR", "SPRITES", "BLIT"
+};
+const char *stageSpans[STAGE_COUNT] = {
+    "frame", "getInput", "updatePlayer", "updateCamera", "updateEntities",
+    "drawMap", "drawBackground", "animateRipple", "drawEntities",
+    "drawPlayer", "flushSprites", "blitDisplay"
+};
+
+/* Must be a power of two */
+#define PROFILE_RING_SIZE 1024
+/* Number of frames the rolling histograms cover */
+#define PROFILE_WINDOW 256
+/* Bucket 0 holds anything under a microsecond. After that there are 8
+ * buckets per power of two, up to about a quarter of a second. */
+#define PROFILE_OCTAVES 18
+#define PROFILE_BUCKETS (1 + PROFILE_OCTAVES * 8)
+/* Input edges followed to the screen at once; any more in one frame
+ * aren't timed */
+#define PROFILE_PENDING_INPUTS 16
+
+typedef struct profileMark {
+    unsigned long long time;
+    int stage;
+    int begin;
+} ProfileMark;
+
+typedef struct profileRing {
+    ProfileMark marks[PROFILE_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    unsigned int dropped;
+} ProfileRing;
+
+typedef struct stageStats {
+    unsigned long long window[PROFILE_WINDOW];
+    int count;
+    int next;
+    int buckets[PROFILE_BUCKETS];
+    /* Accumulation for the frame in progress */
+    unsigned long long start;
+    unsigned long long frameTotal;
+    int depth;
+    int ran;
+} StageStats;
+
+typedef struct profiler {
+    ProfileRing ring;
+    StageStats stages[STAGE_COUNT];
+    int overlay;
+    int report;
+    /* Input latency. An input edge is timed from the key event that
+     * caused it, or, for scripted input, from the start of the frame
+     * that read it, to the step that took it and to the present that
+     * first showed it. */
+    unsigned long long frameStart;
+    unsigned long long eventTime;
+    unsigned long long pending[PROFILE_PENDING_INPUTS];
+    int pendingCount;
+    StageStats inputToStep;
+    StageStats inputToPresent;
+    /* Per-frame counters */
+    unsigned long pixelsBlended;
+    unsigned long lastAllocs;
+} Profiler;
+
+Profiler profiler;
+
+/* Trace events are appended to a per-thread chunk without any
+ * locking. Full chunks are queued for the writer thread, which turns
+ * them into JSON off the critical path and recycles them. Chunks come
+ * straight from malloc rather than memAlloc, so that tracing doesn't
+ * show up in the allocation counts it's tracing. */
+#define TRACE_CHUNK_EVENTS 4096
+
+typedef struct traceEvent {
+    unsigned long long time;
+    const char *name;
+    long value;
+    char phase;
+} TraceEvent;
+
+typedef struct traceChunk {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    int count;
+    int tid;
+    struct traceChunk *next;
+} TraceChunk;
+
+typedef struct tracer {
+    int enabled;
+    FILE *fp;
+    int written;
+    unsigned long long epoch;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    TraceChunk *queue;
+    TraceChunk *queueTail;
+    TraceChunk *spare;
+    int stopping;
+    atomic_int nextTid;
+} Tracer;
+
+Tracer tracer;
+_Thread_local TraceChunk *traceChunk;
+_Thread_local int traceTid;
+
+#define PROFILE_BEGIN(stage) profilePush(stage, 1)
+#define PROFILE_END(stage) profilePush(stage, 0)
+#define PROFILE_CALL(stage, call) \
+    do { PROFILE_BEGIN(stage); call; PROFILE_END(stage); } while (0)
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#define PROFILE_CALL(stage, call) call
+#endif
+
+/*--------------------------------------------------------------------
+ * monotonicNs
+ *
+ * Nanoseconds from an arbitrary fixed point, unaffected by changes to
+ * the wall clock.
+ *--------------------------------------------------------------------*/
+unsigned long long monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef KUJIRA_PROFILE
+/*--------------------------------------------------------------------
+ * traceSubmit
+ *
+ * Queue this thread's chunk for the writer and take a fresh one,
+ * recycled if possible. This is the only place a traced thread takes
+ * the lock, once per TRACE_CHUNK_EVENTS events.
+ *--------------------------------------------------------------------*/
+void traceSubmit()
+{
+    pthread_mutex_lock(&tracer.lock);
+    if (traceChunk) {
+        traceChunk->next = NULL;
+        if (tracer.queueTail) {
+            tracer.queueTail->next = traceChunk;
+        } else {
+            tracer.queue = traceChunk;
         }
+        tracer.queueTail = traceChunk;
+        pthread_cond_signal(&tracer.wake);
+    }
+    traceChunk = tracer.spare;
+    if (traceChunk) {
+        tracer.spare = traceChunk->next;
     }
+    pthread_mutex_unlock(&tracer.lock);
+    if (!traceChunk) {
+        traceChunk = malloc(sizeof(TraceChunk));
+    }
+    traceChunk->count = 0;
+    traceChunk->tid = traceTid;
 }
 
 /*--------------------------------------------------------------------
- * initMap
+ * traceEmit
  *
- * Initialize a tilemap with a random walk. Store the coordinates in
- * an array in the order they are determined by the walk. For each
- * coordinate pair, calculate a unique "flat" coordinate with (y *
- * MAPWIDTH) + x. At the end, use this number to sort the array with
- * the standard library's qsort.
+ * Append an event to this thread's chunk. Phases are Chrome's: 'B'
+ * and 'E' open and close a span, 'C' is a counter sample, and 'M'
+ * names the thread.
  *--------------------------------------------------------------------*/
-void initMap()
+void traceEmit(char phase, const char *name, long value,
+    unsigned long long time)
 {
-    int mapMinX = -(MAPWIDTH / 2);
-    int mapMaxX = MAPWIDTH / 2;
-    int mapMinY = -(MAPHEIGHT / 2);
-    int mapMaxY = MAPHEIGHT / 2;
-    int x = 0;
-    int y = 0;
-    int r1 = 0;
-    int r2 = 0;
-    Tile *tile = tileArray;
-    int i = 0;
-    while (tile - tileArray < MAPLENGTH) {
-        int repeat = 0;
-        /* Check if the current tile proposal is a repeat */
-        for (Tile *p = tileArray; p < tile; ++p) {
-            if (p->x == x && p->y == y) {
-                repeat = 1;
-                break;
-            }
+    if (!traceChunk || traceChunk->count == TRACE_CHUNK_EVENTS) {
+        traceSubmit();
+    }
+    TraceEvent *event = &traceChunk->events[traceChunk->count++];
+    event->time = time;
+    event->name = name;
+    event->value = value;
+    event->phase = phase;
+}
+
+/*--------------------------------------------------------------------
+ * traceThread
+ *
+ * Give the calling thread a trace id and a name in the timeline.
+ *--------------------------------------------------------------------*/
+void traceThread(const char *name)
+{
+    if (!tracer.enabled) {
+        return;
+    }
+    traceTid = atomic_fetch_add(&tracer.nextTid, 1) + 1;
+    traceChunk = NULL;
+    traceEmit('M', name, 0, tracer.epoch);
+}
+
+/*--------------------------------------------------------------------
+ * traceWriteChunk
+ *
+ * Format a chunk's events as trace-event JSON.
+ *--------------------------------------------------------------------*/
+void traceWriteChunk(const TraceChunk *chunk)
+{
+    for (int i = 0; i < chunk->count; ++i) {
+        const TraceEvent *event = &chunk->events[i];
+        double ts = (event->time - tracer.epoch) / 1000.0;
+        fputs(tracer.written++ ? ",\n" : "\n", tracer.fp);
+        if (event->phase == 'M') {
+            fprintf(tracer.fp,
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                chunk->tid, event->name);
+        } else if (event->phase == 'C') {
+            fprintf(tracer.fp,
+                "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"value\":%ld}}",
+                event->name, ts, chunk->tid, event->value);
+        } else {
+            fprintf(tracer.fp,
+                "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,"
+                "\"tid\":%d}",
+                event->name, event->phase, ts, chunk->tid);
         }
-        /* If not, push it onto the array and store a flattened
-         * version of it for a sorted index */
-        if (!repeat) {
-            tile->x = x;
-            tile->y = y;
-            tile->flatCoord = (y * MAPWIDTH) + x;
-            ++tile;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * traceWriter
+ *
+ * Body of the writer thread. Wait for full chunks, write them, and
+ * hand them back for reuse. The writer traces its own flushes.
+ *--------------------------------------------------------------------*/
+void *traceWriter(void *arg)
+{
+    (void)arg;
+    traceThread("trace writer");
+    pthread_mutex_lock(&tracer.lock);
+    for (;;) {
+        while (!tracer.queue && !tracer.stopping) {
+            pthread_cond_wait(&tracer.wake, &tracer.lock);
         }
-        /* Change the directional bias every 20 moves */
-        if (i++ % 20 == 0) {
-            r2 = rand() % 4;
+        TraceChunk *chunks = tracer.queue;
+        tracer.queue = tracer.queueTail = NULL;
+        if (!chunks && tracer.stopping) {
+            break;
         }
-        /* r1 can be one of 4 directions, or a 5th number that hands
-         * the move to the bias r2 */
-        r1 = rand() % 5;
-        if (r1 == 0 || (r1 == 4 && r2 == 0)) {
-            ++x;
-        } else if (r1 == 1 || (r1 == 4 && r2 == 1)) {
-            --x;
-        } else if (r1 == 2 || (r1 == 4 && r2 == 2)) {
-            ++y;
-        } else if (r1 == 3 || (r1 == 4 && r2 == 3)) {
-            --y;
+        pthread_mutex_unlock(&tracer.lock);
+        traceEmit('B', "write trace", 0, monotonicNs());
+        TraceChunk *last = chunks;
+        for (TraceChunk *chunk = chunks; chunk; chunk = chunk->next) {
+            traceWriteChunk(chunk);
+            last = chunk;
         }
-        /* Don't walk past the boundaries */
-        if (x > mapMaxX) x = mapMaxX;
-        if (y > mapMaxY) y = mapMaxY;
-        if (x < mapMinX) x = mapMaxX;
-        if (y < mapMinY) y = mapMaxY;
+        traceEmit('E', "write trace", 0, monotonicNs());
+        pthread_mutex_lock(&tracer.lock);
+        last->next = tracer.spare;
+        tracer.spare = chunks;
     }
-    /* Sort the array by flatCoord for faster access with bsearch */
-    qsort(tileArray, MAPLENGTH, sizeof(Tile), tileCompare);
+    pthread_mutex_unlock(&tracer.lock);
+    /* Nobody else writes our own chunk */
+    if (traceChunk) {
+        traceWriteChunk(traceChunk);
+    }
+    return NULL;
 }
 
 /*--------------------------------------------------------------------
- * blitDisplay
+ * traceStart, traceStop
  *
- * Call SDL functions to blit the display buffer onto the screen.
+ * Open the trace file and start the writer thread; and at exit, hand
+ * over the main thread's last chunk, drain the writer, and close the
+ * JSON. Return 0 if the file can't be opened.
  *--------------------------------------------------------------------*/
-void blitDisplay()
+int traceStart(const char *filename)
 {
-    SDL_RenderClear(display.renderer);
-    SDL_UpdateTexture(
-        display.texture,
-        NULL,
-        display.buffer,
-        display.width * sizeof(int));
-    SDL_RenderCopy(
-        display.renderer,
-        display.texture,
-        NULL, NULL);
-    SDL_RenderPresent(display.renderer);
+    tracer.fp = fopen(filename, "w");
+    if (!tracer.fp) {
+        perror(filename);
+        return 0;
+    }
+    fputs("{\"traceEvents\":[", tracer.fp);
+    tracer.epoch = monotonicNs();
+    pthread_mutex_init(&tracer.lock, NULL);
+    pthread_cond_init(&tracer.wake, NULL);
+    /* Start with a few spare chunks so the main thread doesn't have
+     * to allocate */
+    for (int i = 0; i < 4; ++i) {
+        TraceChunk *chunk = malloc(sizeof(TraceChunk));
+        chunk->next = tracer.spare;
+        tracer.spare = chunk;
+    }
+    tracer.enabled = 1;
+    traceThread("main");
+    pthread_create(&tracer.writer, NULL, traceWriter, NULL);
+    return 1;
+}
+
+void traceStop()
+{
+    if (!tracer.enabled) {
+        return;
+    }
+    traceSubmit();
+    pthread_mutex_lock(&tracer.lock);
+    tracer.stopping = 1;
+    pthread_cond_signal(&tracer.wake);
+    pthread_mutex_unlock(&tracer.lock);
+    pthread_join(tracer.writer, NULL);
+    tracer.enabled = 0;
+    fputs("\n]}\n", tracer.fp);
+    fclose(tracer.fp);
 }
 
 /*--------------------------------------------------------------------
- * initDisplay
+ * profilePush
  *
- * Initialize SDL and display buffer.
+ * Push a begin or end mark for a stage onto the ring, and into the
+ * trace if there is one. If the consumer has fallen a whole ring
+ * behind, drop the mark rather than wait.
  *--------------------------------------------------------------------*/
-void initDisplay()
+void profilePush(int stage, int begin)
 {
-    display.width = DISPLAY_PW;
-    display.height = DISPLAY_PH;
-    display.strideX = 4;
-    display.strideY = display.width * display.strideX;
-    SDL_Init(SDL_INIT_VIDEO);
-    display.window = SDL_CreateWindow(
-        "Kujira",
-        SDL_WINDOWPOS_CENTERED,
-        SDL_WINDOWPOS_CENTERED,
-        display.width, display.height,
-        SDL_WINDOW_RESIZABLE);
-    display.renderer = SDL_CreateRenderer(
-        display.window, -1, SDL_RENDERER_ACCELERATED);
-    display.texture = SDL_CreateTexture(display.renderer,
-        SDL_PIXELFORMAT_RGBA8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        display.width, display.height);
-    SDL_RenderSetLogicalSize(
-        display.renderer,
-        display.width, display.height);
-    display.buffer = malloc(display.strideY * display.height);
+    ProfileRing *ring = &profiler.ring;
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= PROFILE_RING_SIZE) {
+        ++ring->dropped;
+        return;
+    }
+    ProfileMark *mark = &ring->marks[head & (PROFILE_RING_SIZE - 1)];
+    mark->time = monotonicNs();
+    mark->stage = stage;
+    mark->begin = begin;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    if (tracer.enabled) {
+        traceEmit(begin ? 'B' : 'E', stageSpans[stage], 0, mark->time);
+    }
 }
 
 /*--------------------------------------------------------------------
- * drawRect
+ * profileBucket, profileBucketValue
  *
- * Draw a rectangle to the game's display buffer.
+ * Map a duration to its histogram bucket, and a bucket back to the
+ * duration at its midpoint.
  *--------------------------------------------------------------------*/
-void drawRect(Bitmap buffer, int x, int y, int w, int h, unsigned int color)
+int profileBucket(unsigned long long ns)
 {
-    if (x < 0) {
-        w += x;
-        x = 0;
+    if (ns < 1024) {
+        return 0;
     }
-    if (y < 0) {
-        h += y;
-        y = 0;
+    int log2 = 63 - __builtin_clzll(ns);
+    int octave = log2 - 10;
+    if (octave >= PROFILE_OCTAVES) {
+        return PROFILE_BUCKETS - 1;
     }
-    if (x + w >= DISPLAY_PW) w = DISPLAY_PW - x;
-    if (y + h >= DISPLAY_PH) h = DISPLAY_PH - y;
-    unsigned int *pixel = buffer.data;
-    pixel += y * buffer.width;
-    pixel += x;
-    for (int rectY = 0; rectY < h; ++rectY) {
-        for (int rectX = 0; rectX < w; ++rectX) {
-            applyColor(color, pixel + rectX);
-        }
-        pixel += buffer.width;
+    int sub = (ns >> (log2 - 3)) & 7;
+    return 1 + octave * 8 + sub;
+}
+
+unsigned long long profileBucketValue(int bucket)
+{
+    if (bucket == 0) {
+        return 512;
     }
+    int octave = (bucket - 1) / 8;
+    int sub = (bucket - 1) % 8;
+    unsigned long long base = 1ull << (octave + 10);
+    return base + (base / 8) * sub + base / 16;
 }
 
 /*--------------------------------------------------------------------
- * drawMap
+ * profileAddSample
  *
- * Draw a new portion of the map onto the newer of two buffers
- * whenever the camera scrolls. The actual displaying of the buffer is
- * accomplished by just copying the contents of these two buffers to
- * the game's display buffer, so that the expensive calculations in
- * this function don't need to be performed during most frames.
+ * Add a duration to a stage's window, retiring the oldest sample from
+ * the histogram once the window is full.
  *--------------------------------------------------------------------*/
-void drawMap()
+void profileAddSample(StageStats *stats, unsigned long long ns)
 {
-    /* We want to scroll into the next portion of the map when the
-     * player steps into it, but we also don't want to recalculate the
-     * visible map on each frame, so we need to keep two buffers: the
-     * current (old) and the one to be scrolled into (new). The new
-     * becomes the old whenever this function is called, which is only
-     * when it's time to scroll. */
-    memcpy(
-        bgBufferOld.data,
-        bgBufferNew.data,
-        bgBufferNew.width * bgBufferNew.height * sizeof(int));
-    bgBufferOld.width = bgBufferNew.width;
-    bgBufferOld.height = bgBufferNew.height;
-    fillBitmap(&bgBufferNew, 0xeb9b34ff); // gold
-    int pixelX = 0;
-    int pixelY = 0;
-    int centerX = DISPLAY_TW / 2;
-    int centerY = DISPLAY_TH / 2;
-    /* Draw tiles from the map with the camera as center point */
-    for (int y = cam.destTileY - centerY; y < cam.destTileY + centerY + 2; ++y) {
-        for (int x = cam.destTileX - centerX; x < cam.destTileX + centerX + 1; ++x) {
-            Tile tile;
-            tile.x = x;
-            tile.y = y;
-            tile.flatCoord = (tile.y * MAPWIDTH) + tile.x;
-            if (bsearch(&tile, tileArray, MAPLENGTH, sizeof(Tile), tileCompare)) {
-                unsigned int color = 0x4f4f9fff; // blue
-                /* Tile's shadow */
-                drawRect(
-                    bgBufferNew,
-                    pixelX,
-                    pixelY,
-                    TILESIZE,
-                    TILESIZE,
-                    0x000000ff);
-                /* Actual tile */
-                drawRect(
-                    bgBufferNew,
-                    pixelX - 2,
-                    pixelY - 2,
-                    TILESIZE - 2,
-                    TILESIZE - 2,
-                    color);
-            }
-            pixelX += TILESIZE;
-        }
-        pixelX = 0;
-        pixelY += TILESIZE;
+    if (stats->count == PROFILE_WINDOW) {
+        --stats->buckets[profileBucket(stats->window[stats->next])];
+    } else {
+        ++stats->count;
     }
+    stats->window[stats->next] = ns;
+    ++stats->buckets[profileBucket(ns)];
+    stats->next = (stats->next + 1) % PROFILE_WINDOW;
 }
 
 /*--------------------------------------------------------------------
- * drawBackground
+ * profileMax, profilePercentile
  *
- * This function, which, unlike drawMap, is called every frame,
+ * Read the exact maximum from a stage's window, or a percentile (0 to
+ * 1) from its histogram.
+ *--------------------------------------------------------------------*/
+unsigned long long profileMax(const StageStats *stats)
+{
+    unsigned long long max = 0;
+    for (int i = 0; i < stats->count; ++i) {
+        if (stats->window[i] > max) {
+            max = stats->window[i];
+        }
+    }
+    return max;
+}
+
+unsigned long long profilePercentile(const StageStats *stats, float p)
+{
+    int target = (int)ceilf(p * stats->count);
+    int seen = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; ++i) {
+        seen += stats->buckets[i];
+        if (seen >= target && seen > 0) {
+            /* A bucket's midpoint can overshoot the largest sample */
+            unsigned long long value = profileBucketValue(i);
+            unsigned long long max = profileMax(stats);
+            return value < max ? value : max;
+        }
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------
+ * profileEndFrame
+ *
+ * Drain the ring and add the time each stage spent in this frame to
+ * its histogram. A stage that was entered several times in one frame
+ * counts once, with its times summed, and a stage that didn't run
+ * this frame (drawMap, usually) adds nothing. Then sample the
+ * per-frame counters into the trace.
+ *--------------------------------------------------------------------*/
+void profileEndFrame()
+{
+    ProfileRing *ring = &profiler.ring;
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail != head; ++tail) {
+        ProfileMark *mark = &ring->marks[tail & (PROFILE_RING_SIZE - 1)];
+        StageStats *stats = &profiler.stages[mark->stage];
+        if (mark->begin) {
+            if (stats->depth++ == 0) {
+                stats->start = mark->time;
+            }
+        } else if (stats->depth > 0 && --stats->depth == 0) {
+            stats->frameTotal += mark->time - stats->start;
+            stats->ran = 1;
+        }
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        StageStats *stats = &profiler.stages[i];
+        if (stats->ran) {
+            profileAddSample(stats, stats->frameTotal);
+            stats->frameTotal = 0;
+            stats->ran = 0;
+        }
+    }
+    if (tracer.enabled) {
+        unsigned long long now = monotonicNs();
+        traceEmit('C', "pixels blended", profiler.pixelsBlended, now);
+        traceEmit('C', "allocations",
+            memStats.allocs - profiler.lastAllocs, now);
+        traceEmit('C', "live allocations",
+            memStats.allocs - memStats.frees, now);
+        for (int i = 0; i < MEM_TAG_COUNT; ++i) {
+            traceEmit('C', memTagCounters[i], memStats.tags[i].live, now);
+        }
+    }
+    profiler.pixelsBlended = 0;
+    profiler.lastAllocs = memStats.allocs;
+}
+
+/*--------------------------------------------------------------------
+ * profileInputEdge, profilePresented
+ *
+ * Start timing the step's input if a key went down on it, and, once
+ * the frame that shows it has been presented, finish timing every
+ * input edge since the last present.
+ *--------------------------------------------------------------------*/
+void profileInputEdge()
+{
+    unsigned long long time = profiler.eventTime
+        ? profiler.eventTime : profiler.frameStart;
+    profiler.eventTime = 0;
+    int edge = 0;
+    for (int i = 0; i < INPUT_KEY_COUNT; ++i) {
+        size_t offset = inputKeys[i].offset;
+        if (*(int *)((char *)&newInput + offset)
+            && !*(int *)((char *)&oldInput + offset)) {
+            edge = 1;
+        }
+    }
+    if (!edge || profiler.pendingCount == PROFILE_PENDING_INPUTS) {
+        return;
+    }
+    unsigned long long now = monotonicNs();
+    profileAddSample(&profiler.inputToStep, now > time ? now - time : 0);
+    profiler.pending[profiler.pendingCount++] = time;
+}
+
+void profilePresented()
+{
+    unsigned long long now = monotonicNs();
+    for (int i = 0; i < profiler.pendingCount; ++i) {
+        unsigned long long time = profiler.pending[i];
+        unsigned long long latency = now > time ? now - time : 0;
+        profileAddSample(&profiler.inputToPresent, latency);
+        if (tracer.enabled) {
+            traceEmit('C', "input latency (us)", latency / 1000, now);
+        }
+    }
+    profiler.pendingCount = 0;
+}
+
+/*--------------------------------------------------------------------
+ * profileReport
+ *
+ * Print the current p50, p99, and max of every stage in milliseconds.
+ *--------------------------------------------------------------------*/
+void profileReport(FILE *fp)
+{
+    fprintf(fp, "%-10s %8s %8s %8s\n", "stage (ms)", "p50", "p99", "max");
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const StageStats *stats = &profiler.stages[i];
+        if (stats->count == 0) {
+            continue;
+        }
+        fprintf(fp, "%-10s %8.3f %8.3f %8.3f\n", stageNames[i],
+            profilePercentile(stats, 0.50f) / 1e6,
+            profilePercentile(stats, 0.99f) / 1e6,
+            profileMax(stats) / 1e6);
+    }
+    const StageStats *latencies[2] = {
+        &profiler.inputToStep, &profiler.inputToPresent};
+    const char *latencyNames[2] = {"input>step", "input>show"};
+    for (int i = 0; i < 2; ++i) {
+        if (latencies[i]->count == 0) {
+            continue;
+        }
+        fprintf(fp, "%-10s %8.3f %8.3f %8.3f\n", latencyNames[i],
+            profilePercentile(latencies[i], 0.50f) / 1e6,
+            profilePercentile(latencies[i], 0.99f) / 1e6,
+            profileMax(latencies[i]) / 1e6);
+    }
+    if (profiler.ring.dropped) {
+        fprintf(fp, "%u marks dropped\n", profiler.ring.dropped);
+    }
+    if (frameArena.peak) {
+        fprintf(fp, "frame arena: peak %zu KB of %zu KB\n",
+            frameArena.peak / 1024, frameArena.size / 1024);
+    }
+    fprintf(fp, "%-12s %9s %9s %9s %12s\n",
+        "memory", "live KB", "peak KB", "allocs", "allocs/frame");
+    for (int i = 0; i < MEM_TAG_COUNT; ++i) {
+        const MemTagStats *stats = &memStats.tags[i];
+        if (stats->allocs == 0) {
+            continue;
+        }
+        fprintf(fp, "%-12s %9.1f %9.1f %9lu %12.3f\n", memTagNames[i],
+            stats->live / 1024.0, stats->peak / 1024.0, stats->allocs,
+            frameCount ? (double)stats->allocs / frameCount : 0.0);
+    }
+    fprintf(fp, "%-12s %9.1f %9.1f %9lu %12.3f\n", "total",
+        memStats.live / 1024.0, memStats.peak / 1024.0, memStats.allocs,
+        frameCount ? (double)memStats.allocs / frameCount : 0.0);
+    if (inputQueue.dropped) {
+        fprintf(fp, "%u input events dropped\n", inputQueue.dropped);
+    }
+    if (idle.skipped) {
+        fprintf(fp, "idle: %ld frames not drawn, %ld waits\n",
+            idle.skipped, idle.waits);
+    }
+    if (pacer.frames) {
+        fprintf(fp, "pacing: %.1f Hz%s, %ld of %ld frames missed, "
+            "error mean %.3f ms, rms %.3f ms, max %.3f ms\n",
+            1e9 / pacer.period, pacer.vsync ? " vsync" : "",
+            pacer.missed, pacer.frames,
+            pacer.errorSum / pacer.frames / 1e6,
+            sqrt(pacer.errorSquares / pacer.frames) / 1e6,
+            pacer.errorMax / 1e6);
+    }
+}
+#endif
+
+/*--------------------------------------------------------------------
+ * sleepUntil
+ *
+ * Sleep until the monotonic clock reaches the given time.
+ *--------------------------------------------------------------------*/
+void sleepUntil(unsigned long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/*--------------------------------------------------------------------
+ * initPacer
+ *
+ * Pace frames to the rate asked for on the command line, or else to
+ * the display's refresh rate, or to DEFAULT_RENDER_RATE if that isn't
+ * known. The simulation keeps its own rate whatever this is.
+ *--------------------------------------------------------------------*/
+void initPacer()
+{
+    if (options.renderRate > 0) {
+        pacer.period = 1000000000ull / options.renderRate;
+    } else if (display.refreshRate > 0) {
+        pacer.period = 1000000000ull / display.refreshRate;
+    } else {
+        pacer.period = 1000000000ull / DEFAULT_RENDER_RATE;
+    }
+    /* A starting guess, until the first few sleeps have been timed */
+    pacer.margin = 1000000;
+    pacer.deadline = monotonicNs();
+}
+
+/*--------------------------------------------------------------------
+ * pacerRecord
+ *
+ * Note how far the time since the last frame was from the period. A
+ * frame that took more than one and a half periods missed its
+ * deadline.
+ *--------------------------------------------------------------------*/
+void pacerRecord(unsigned long long now)
+{
+    if (pacer.lastFrame) {
+        double error = (double)(now - pacer.lastFrame) - pacer.period;
+        ++pacer.frames;
+        pacer.errorSum += fabs(error);
+        pacer.errorSquares += error * error;
+        if (fabs(error) > pacer.errorMax) {
+            pacer.errorMax = fabs(error);
+        }
+        if (error > pacer.period / 2) {
+            ++pacer.missed;
+        }
+    }
+    pacer.lastFrame = now;
+}
+
+/*--------------------------------------------------------------------
+ * pacerWait
+ *
+ * Wait out the rest of the frame. Without vsync, sleep until the
+ * margin before the deadline, then spin. The margin follows a running
+ * average of how late sleeps wake up, so it shrinks on a quiet machine
+ * and grows on a loaded one.
+ *--------------------------------------------------------------------*/
+void pacerWait()
+{
+    unsigned long long now = monotonicNs();
+    if (!pacer.vsync) {
+        pacer.deadline += pacer.period;
+        if (now + pacer.margin < pacer.deadline) {
+            unsigned long long wake = pacer.deadline - pacer.margin;
+            sleepUntil(wake);
+            now = monotonicNs();
+            pacer.oversleep = 0.9f * pacer.oversleep + 0.1f * (now - wake);
+            pacer.margin = 2 * pacer.oversleep + 50000;
+            if (pacer.margin > 2000000) {
+                pacer.margin = 2000000;
+            }
+        }
+        while (now < pacer.deadline) {
+            now = monotonicNs();
+        }
+        /* Don't try to make up for frames that overran */
+        if (now > pacer.deadline + pacer.period) {
+            pacer.deadline = now;
+        }
+    }
+    pacerRecord(now);
+}
+
+/*--------------------------------------------------------------------
+ * tileCompare
+ *
+ * For the bsearch routine to find a tile by its flattened coordinate
+ * number. Returns 0 if equal.
+ *--------------------------------------------------------------------*/
+int tileCompare(const void *a, const void *b)
+{
+    return ((Tile *)a)->flatCoord - ((Tile *)b)->flatCoord;
+}
+
+/*--------------------------------------------------------------------
+ * borderCollide
+ *
+ * Return 0 for "no collide" if there is a tile at the given x and y
+ * coordinates. Return 1 for "collide" if there is no tile.
+ *--------------------------------------------------------------------*/
+int borderCollide(int x, int y)
+{
+    Tile tile;
+    tile.x = x;
+    tile.y = y;
+    tile.flatCoord = (tile.y * MAPWIDTH) + tile.x;
+    if (bsearch(&tile, tileArray, mapLength, sizeof(Tile), tileCompare)) {
+        return 0;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * applyColor
+ *
+ * Blend the src color with whatever color is already at *dest, in
+ * accordance with the former's alpha channel.
+ *--------------------------------------------------------------------*/
+void applyColor(unsigned int src, unsigned int *dest)
+{
+    /* Linear blend:
+     *
+     * C = A + t(B - A)
+     *   = A + tB - tA
+     *   = A - tA + tB
+     * C = (1 - t)A + tB
+     *
+     * The first ordering of the equation says that the resulting color
+     * is some portion t, the alpha channel, of the distance between A
+     * and B, i.e. the destination and source pixels. The final
+     * reordering of this equation says that the resulting color is the
+     * alpha portion of B, plus a portion of A equal to the sacrificed
+     * portion of B. */
+#ifdef KUJIRA_PROFILE
+    ++profiler.pixelsBlended;
+#endif
+    float a = (src & 0xFF) / 255.0f;
+    int r = ((1 - a) * (*dest >> 24 & 0xFF)) + (a * (src >> 24 & 0xFF));
+    int g = ((1 - a) * (*dest >> 16 & 0xFF)) + (a * (src >> 16 & 0xFF));
+    int b = ((1 - a) * (*dest >> 8 & 0xFF)) + (a * (src >> 8 & 0xFF));
+    *dest = r << 24 | g << 16 | b << 8 | (src & 0xFF);
+}
+
+/*--------------------------------------------------------------------
+ * bmpChannel, bmpPixel
+ *
+ * Pull the channel under a mask out of a pixel and widen it to eight
+ * bits, and put four such channels together as an engine pixel. A
+ * mask of 0 means the channel isn't there, which for alpha means
+ * opaque.
+ *--------------------------------------------------------------------*/
+unsigned int bmpChannel(unsigned int pixel, unsigned int mask, unsigned int absent)
+{
+    if (!mask) {
+        return absent;
+    }
+    unsigned int value = (pixel & mask) >> __builtin_ctz(mask);
+    int bits = __builtin_popcount(mask);
+    if (bits >= 8) {
+        return value >> (bits - 8);
+    }
+    return value * 255 / ((1u << bits) - 1);
+}
+
+unsigned int bmpPixel(unsigned int r, unsigned int g, unsigned int b, unsigned int a)
+{
+    return a ? r << 24 | g << 16 | b << 8 | a : 0;
+}
+
+/*--------------------------------------------------------------------
+ * bmpDecodeRle
+ *
+ * Decode RLE8 or RLE4 data into a bitmap through a palette. RLE
+ * bitmaps are always stored bottom-up. Pixels that a delta skips over
+ * are left transparent. Return 0 if the data runs out or points
+ * outside the bitmap.
+ *--------------------------------------------------------------------*/
+int bmpDecodeRle(const unsigned char *src, const unsigned char *end,
+    int bits, const unsigned int *palette, int colors, Bitmap *bitmap)
+{
+    int x = 0, y = 0;
+    while (src + 2 <= end) {
+        int count = src[0];
+        int value = src[1];
+        src += 2;
+        if (count > 0) {
+            /* A run of one index, or of two alternating nibbles */
+            for (int i = 0; i < count && x < bitmap->width; ++i, ++x) {
+                int index = bits == 8 ? value
+                    : (i & 1) ? value & 15 : value >> 4;
+                if (y < bitmap->height && index < colors) {
+                    bitmap->data[(bitmap->height - 1 - y) * bitmap->stride + x]
+                        = palette[index];
+                }
+            }
+        } else if (value == 0) {
+            x = 0;
+            ++y;
+        } else if (value == 1) {
+            return 1;
+        } else if (value == 2) {
+            if (src + 2 > end) {
+                return 0;
+            }
+            x += src[0];
+            y += src[1];
+            src += 2;
+        } else {
+            /* An absolute run of value indices, padded to a word */
+            int bytes = bits == 8 ? value : (value + 1) / 2;
+            if (src + bytes > end) {
+                return 0;
+            }
+            for (int i = 0; i < value && x < bitmap->width; ++i, ++x) {
+                int index = bits == 8 ? src[i]
+                    : (i & 1) ? src[i / 2] & 15 : src[i / 2] >> 4;
+                if (y < bitmap->height && index < colors) {
+                    bitmap->data[(bitmap->height - 1 - y) * bitmap->stride + x]
+                        = palette[index];
+                }
+            }
+            src += (bytes + 1) & ~1;
+        }
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * loadBitmap
+ *
+ * Map a Windows BMP file into memory and convert it to the engine's
+ * pixel format. Handles 24- and 32-bit pixels, 16- and 32-bit
+ * BI_BITFIELDS with any masks, 4- and 8-bit palettes, plain or RLE
+ * compressed, and both bottom-up and top-down row order. A 32-bit
+ * file that's already in the engine's format is copied a row at a
+ * time. Return a bitmap with no data if the file can't be loaded.
+ *--------------------------------------------------------------------*/
+Bitmap loadBitmap(const char *filename)
+{
+    Bitmap bitmap = {0};
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return bitmap;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 54) {
+        fprintf(stderr, "%s: not a BMP file\n", filename);
+        close(fd);
+        return bitmap;
+    }
+    size_t size = st.st_size;
+    unsigned char *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return bitmap;
+    }
+    const unsigned char *end = file + size;
+    WindowsBMP bmp;
+    memcpy(&bmp.header, file, sizeof(BitmapHeader));
+    const char *error = NULL;
+    int width = bmp.header.width;
+    int height = abs(bmp.header.height);
+    int bits = bmp.header.bitsperpixel;
+    int compression = bmp.header.compression;
+    size_t rowSize = ((size_t)width * bits + 31) / 32 * 4;
+    if (bmp.header.signature != 0x4d42 || bmp.header.infoheadersize < 40) {
+        error = "not a BMP file";
+    } else if (width <= 0 || height <= 0 || width > 16384 || height > 16384) {
+        error = "bad dimensions";
+    } else if (bmp.header.dataoffset <= 0
+        || (size_t)bmp.header.dataoffset >= size) {
+        error = "bad data offset";
+    } else if (compression != BI_RLE8 && compression != BI_RLE4
+        && (size_t)bmp.header.dataoffset + rowSize * height > size) {
+        error = "truncated";
+    }
+    /* The masks follow a plain info header, or are part of a larger
+     * one. Only a header with room for it has an alpha mask. */
+    unsigned int masks[4] = {0, 0, 0, 0};
+    int hasAlpha = bmp.header.infoheadersize >= 56
+        || compression == BI_ALPHABITFIELDS;
+    if (!error && (compression == BI_BITFIELDS
+        || compression == BI_ALPHABITFIELDS)) {
+        if (bits != 16 && bits != 32) {
+            error = "unsupported bitfields depth";
+        } else if (54 + (hasAlpha ? 16 : 12) > size) {
+            error = "truncated";
+        } else {
+            memcpy(masks, file + 54, hasAlpha ? 16 : 12);
+        }
+    } else if (!error && compression == BI_RGB && bits == 16) {
+        masks[0] = 0x7c00;
+        masks[1] = 0x03e0;
+        masks[2] = 0x001f;
+    } else if (!error && compression == BI_RGB && bits == 32) {
+        masks[0] = 0x00ff0000;
+        masks[1] = 0x0000ff00;
+        masks[2] = 0x000000ff;
+        masks[3] = 0xff000000;
+    } else if (!error && compression == BI_RLE8 && bits != 8) {
+        error = "RLE8 needs 8-bit pixels";
+    } else if (!error && compression == BI_RLE4 && bits != 4) {
+        error = "RLE4 needs 4-bit pixels";
+    } else if (!error && compression != BI_RGB && compression != BI_RLE8
+        && compression != BI_RLE4) {
+        error = "unsupported compression";
+    } else if (!error && bits != 4 && bits != 8 && bits != 24) {
+        error = "unsupported depth";
+    }
+    /* Palettes are blue, green, red, unused, and always opaque */
+    unsigned int palette[256];
+    int colors = 0;
+    if (!error && bits <= 8) {
+        const unsigned char *entry = file + 14 + bmp.header.infoheadersize;
+        colors = bmp.header.colorsused ? bmp.header.colorsused : 1 << bits;
+        if (colors > 1 << bits) {
+            colors = 1 << bits;
+        }
+        if (entry + colors * 4 > end) {
+            error = "truncated palette";
+        }
+        for (int i = 0; !error && i < colors; ++i, entry += 4) {
+            palette[i] = bmpPixel(entry[2], entry[1], entry[0], 255);
+        }
+    }
+    if (error) {
+        fprintf(stderr, "%s: %s\n", filename, error);
+        munmap(file, size);
+        return bitmap;
+    }
+    bitmap = newBitmap(width, height, MEM_ASSETS);
+    const unsigned char *data = file + bmp.header.dataoffset;
+    /* Rows are stored bottom-up unless the height is negative */
+    int bottomUp = bmp.header.height > 0;
+    /* Plain 32-bit BMPs usually leave the alpha byte unused, in which
+     * case they're opaque */
+    if (compression == BI_RGB && bits == 32) {
+        int anyAlpha = 0;
+        for (int y = 0; y < height && !anyAlpha; ++y) {
+            const unsigned char *row = data + y * rowSize;
+            for (int x = 0; x < width; ++x) {
+                if (row[x * 4 + 3]) {
+                    anyAlpha = 1;
+                    break;
+                }
+            }
+        }
+        if (!anyAlpha) {
+            masks[3] = 0;
+        }
+    }
+    if (compression == BI_RLE8 || compression == BI_RLE4) {
+        if (!bmpDecodeRle(data, end, bits, palette, colors, &bitmap)) {
+            fprintf(stderr, "%s: bad RLE data\n", filename);
+        }
+    } else if (bits == 32 && masks[0] == ENGINE_RMASK
+        && masks[1] == ENGINE_GMASK && masks[2] == ENGINE_BMASK
+        && masks[3] == ENGINE_AMASK) {
+        for (int y = 0; y < height; ++y) {
+            unsigned int *dest = bitmap.data + y * bitmap.stride;
+            memcpy(dest, data + (bottomUp ? height - 1 - y : y) * rowSize,
+                width * sizeof(int));
+            for (int x = 0; x < width; ++x) {
+                if (!(dest[x] & ENGINE_AMASK)) {
+                    dest[x] = 0;
+                }
+            }
+        }
+    } else {
+        for (int y = 0; y < height; ++y) {
+            const unsigned char *src = data
+                + (bottomUp ? height - 1 - y : y) * rowSize;
+            unsigned int *dest = bitmap.data + y * bitmap.stride;
+            for (int x = 0; x < width; ++x) {
+                unsigned int pixel;
+                switch (bits) {
+                case 4:
+                    pixel = (src[x / 2] >> ((x & 1) ? 0 : 4)) & 15;
+                    dest[x] = pixel < (unsigned int)colors ? palette[pixel] : 0;
+                    continue;
+                case 8:
+                    pixel = src[x];
+                    dest[x] = pixel < (unsigned int)colors ? palette[pixel] : 0;
+                    continue;
+                case 16:
+                    pixel = src[x * 2] | src[x * 2 + 1] << 8;
+                    break;
+                case 24:
+                    dest[x] = bmpPixel(src[x * 3 + 2], src[x * 3 + 1],
+                        src[x * 3], 255);
+                    continue;
+                default:
+                    memcpy(&pixel, src + x * 4, sizeof(pixel));
+                    break;
+                }
+                dest[x] = bmpPixel(
+                    bmpChannel(pixel, masks[0], 0),
+                    bmpChannel(pixel, masks[1], 0),
+                    bmpChannel(pixel, masks[2], 0),
+                    bmpChannel(pixel, masks[3], 255));
+            }
+        }
+    }
+    munmap(file, size);
+    return bitmap;
+}
+
+/*--------------------------------------------------------------------
+ * openArchive
+ *
+ * Map an asset archive into memory and check that its table fits.
+ * The images themselves are checked as they're looked up. Return 0 if
+ * there's no usable archive.
+ *--------------------------------------------------------------------*/
+int openArchive(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ArchiveHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    unsigned char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    const ArchiveHeader *header = (const ArchiveHeader *)base;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, 4) != 0
+        || header->version != ARCHIVE_VERSION
+        || sizeof(ArchiveHeader) + (size_t)header->count * sizeof(ArchiveEntry) > size) {
+        fprintf(stderr, "%s: not a usable archive\n", filename);
+        munmap(base, size);
+        return 0;
+    }
+    archive.base = base;
+    archive.size = size;
+    archive.header = header;
+    archive.entries = (const ArchiveEntry *)(header + 1);
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * archiveImage
+ *
+ * A bitmap pointing into the archive at an image, or one with no data
+ * if the image doesn't fit in the archive. Archive bitmaps are read
+ * only.
+ *--------------------------------------------------------------------*/
+Bitmap archiveImage(const ArchiveImage *image)
+{
+    Bitmap bitmap = {0};
+    size_t bytes = (size_t)image->stride * image->height * sizeof(int);
+    if (image->width <= 0 || image->height <= 0
+        || image->stride < image->width
+        || image->offset % BITMAP_ALIGN != 0
+        || image->offset + bytes > archive.size) {
+        return bitmap;
+    }
+    bitmap.data = (unsigned int *)(archive.base + image->offset);
+    bitmap.width = image->width;
+    bitmap.height = image->height;
+    bitmap.stride = image->stride;
+    return bitmap;
+}
+
+/*--------------------------------------------------------------------
+ * archiveBitmap
+ *
+ * Look up an asset by name in the archive and point a bitmap, and its
+ * pose frames if wanted, at its pixels. Return 0 if it isn't there.
+ *--------------------------------------------------------------------*/
+int archiveBitmap(const char *name, Bitmap *bitmap, Bitmap *poses)
+{
+    if (!archive.base) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < archive.header->count; ++i) {
+        const ArchiveEntry *entry = &archive.entries[i];
+        if (strncmp(entry->name, name, ARCHIVE_NAME_SIZE) != 0) {
+            continue;
+        }
+        *bitmap = archiveImage(&entry->image);
+        for (int j = 0; poses && j < POSE_COUNT; ++j) {
+            poses[j] = archiveImage(&entry->poses[j]);
+            if (!poses[j].data) {
+                poses[0].data = NULL;
+                break;
+            }
+        }
+        return bitmap->data != NULL;
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------
+ * inArchive
+ *
+ * Whether a bitmap's pixels are in the mapped archive.
+ *--------------------------------------------------------------------*/
+int inArchive(Bitmap bitmap)
+{
+    const unsigned char *data = (const unsigned char *)bitmap.data;
+    return archive.base && data >= archive.base
+        && data < archive.base + archive.size;
+}
+
+/*--------------------------------------------------------------------
+ * loadAsset
+ *
+ * Load an asset the first time from the archive, named after its file
+ * without the directory or extension, or failing that from the file
+ * itself. Reloads always come from the file, which is what changed.
+ * Runs on the loader thread. Return 0 if it can't be loaded.
+ *--------------------------------------------------------------------*/
+int loadAsset(const char *path, int reload, Asset *asset)
+{
+    memset(asset, 0, sizeof(*asset));
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char name[ARCHIVE_NAME_SIZE];
+    size_t length = strcspn(base, ".");
+    if (!reload && length < ARCHIVE_NAME_SIZE) {
+        memcpy(name, base, length);
+        name[length] = '\0';
+        if (archiveBitmap(name, &asset->bitmap, asset->poses)) {
+            return 1;
+        }
+        memset(asset->poses, 0, sizeof(asset->poses));
+    }
+    asset->bitmap = loadBitmap(path);
+    asset->owned = 1;
+    return asset->bitmap.data != NULL;
+}
+
+/*--------------------------------------------------------------------
+ * freeAsset
+ *
+ * Give back an asset's memory, if it has its own.
+ *--------------------------------------------------------------------*/
+void freeAsset(Asset *asset)
+{
+    if (asset->owned) {
+        memFree(asset->bitmap.data);
+    }
+    memset(asset, 0, sizeof(*asset));
+}
+
+/*--------------------------------------------------------------------
+ * queueReloads
+ *
+ * Queue every resource named in a batch of inotify events for loading
+ * again. Called with the lock held.
+ *--------------------------------------------------------------------*/
+void queueReloads(const char *events, ssize_t length)
+{
+    const struct inotify_event *event;
+    for (const char *p = events; p < events + length;
+        p += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event *)p;
+        if (!event->len) {
+            continue;
+        }
+        for (int i = 0; i < MAX_RESOURCES; ++i) {
+            Resource *r = &resources.slots[i];
+            const char *base = strrchr(r->path, '/')
+                ? strrchr(r->path, '/') + 1 : r->path;
+            if (r->refs && r->watch == event->wd
+                && strcmp(base, event->name) == 0) {
+                r->state = RESOURCE_QUEUED;
+            }
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * resourceLoader
+ *
+ * The loader thread: sleep until there's a resource queued or a file
+ * changes, then load whatever is queued, one at a time, without
+ * holding the lock while it's at it.
+ *--------------------------------------------------------------------*/
+void *resourceLoader(void *arg)
+{
+    (void)arg;
+    struct pollfd fds[2] = {
+        {resources.wakeFds[0], POLLIN, 0},
+        {resources.inotify, POLLIN, 0}
+    };
+    char events[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    char buffer[64];
+    for (;;) {
+        pthread_mutex_lock(&resources.lock);
+        int stopping = resources.stopping;
+        Resource *next = NULL;
+        for (int i = 0; i < MAX_RESOURCES && !next; ++i) {
+            if (resources.slots[i].state == RESOURCE_QUEUED) {
+                next = &resources.slots[i];
+            }
+        }
+        char path[RESOURCE_PATH_SIZE];
+        unsigned int serial = 0;
+        int reload = 0;
+        if (next) {
+            next->state = RESOURCE_LOADING;
+            memcpy(path, next->path, sizeof(path));
+            serial = next->serial;
+            reload = next->loaded;
+        }
+        pthread_mutex_unlock(&resources.lock);
+        if (stopping) {
+            break;
+        }
+        if (next) {
+            Asset asset;
+            int ok = loadAsset(path, reload, &asset);
+            pthread_mutex_lock(&resources.lock);
+            if (next->serial != serial || !next->refs) {
+                freeAsset(&asset);
+            } else {
+                /* A reload that fails leaves the old asset in place,
+                 * and the next change to the file tries again */
+                if (ok) {
+                    if (next->hasPending) {
+                        freeAsset(&next->pending);
+                    }
+                    next->pending = asset;
+                    next->hasPending = 1;
+                    next->loaded = 1;
+                    if (reload) {
+                        fprintf(stderr, "%s: reloaded\n", path);
+                    }
+                }
+                if (next->state == RESOURCE_LOADING) {
+                    next->state = RESOURCE_READY;
+                }
+            }
+            pthread_cond_broadcast(&resources.loaded);
+            pthread_mutex_unlock(&resources.lock);
+            continue;
+        }
+        if (poll(fds, resources.inotify >= 0 ? 2 : 1, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            while (read(resources.wakeFds[0], buffer, sizeof(buffer)) > 0) {
+            }
+        }
+        if (resources.inotify >= 0 && (fds[1].revents & POLLIN)) {
+            ssize_t length;
+            while ((length = read(resources.inotify, events, sizeof(events))) > 0) {
+                pthread_mutex_lock(&resources.lock);
+                queueReloads(events, length);
+                pthread_mutex_unlock(&resources.lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------
+ * wakeLoader
+ *
+ * Tell the loader thread to look for work.
+ *--------------------------------------------------------------------*/
+void wakeLoader()
+{
+    ssize_t written = write(resources.wakeFds[1], "", 1);
+    (void)written;
+}
+
+/*--------------------------------------------------------------------
+ * startResources, stopResources
+ *
+ * Start the loader thread, watching for changes to the assets if hot
+ * is set, and stop it again. Stopping closes everything starting
+ * opened, and frees the atlas, so every resource should have been
+ * released by then.
+ *--------------------------------------------------------------------*/
+int startResources(int hot)
+{
+    if (pipe(resources.wakeFds) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(resources.wakeFds[i], F_SETFL, O_NONBLOCK);
+        fcntl(resources.wakeFds[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (hot) {
+        resources.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (resources.inotify < 0) {
+            perror("inotify");
+        }
+    }
+    if (pthread_create(&resources.loader, NULL, resourceLoader, NULL) != 0) {
+        fprintf(stderr, "can't start the resource loader\n");
+        return 0;
+    }
+    resources.started = 1;
+    return 1;
+}
+
+void stopResources()
+{
+    if (!resources.started) {
+        return;
+    }
+    pthread_mutex_lock(&resources.lock);
+    resources.stopping = 1;
+    pthread_mutex_unlock(&resources.lock);
+    wakeLoader();
+    pthread_join(resources.loader, NULL);
+    resources.started = 0;
+    resources.stopping = 0;
+    close(resources.wakeFds[0]);
+    close(resources.wakeFds[1]);
+    if (resources.inotify >= 0) {
+        close(resources.inotify);
+        resources.inotify = -1;
+    }
+    for (int i = 0; i < atlas.pageCount; ++i) {
+        memFree(atlas.pages[i].data);
+    }
+    atlas.pageCount = 0;
+}
+
+/*--------------------------------------------------------------------
+ * acquireBitmap
+ *
+ * Return a handle to the bitmap at a path, taking a reference to it.
+ * The first reference queues it for loading. Return 0 if there's no
+ * room for another resource.
+ *--------------------------------------------------------------------*/
+ResourceHandle acquireBitmap(const char *path)
+{
+    if (strlen(path) >= RESOURCE_PATH_SIZE) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return 0;
+    }
+    pthread_mutex_lock(&resources.lock);
+    Resource *slot = NULL;
+    for (int i = 0; i < MAX_RESOURCES; ++i) {
+        Resource *r = &resources.slots[i];
+        if (r->refs && strcmp(r->path, path) == 0) {
+            ++r->refs;
+            pthread_mutex_unlock(&resources.lock);
+            return i + 1;
+        }
+        if (!r->refs && !slot) {
+            slot = r;
+        }
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&resources.lock);
+        fprintf(stderr, "%s: too many resources\n", path);
+        return 0;
+    }
+    strcpy(slot->path, path);
+    slot->refs = 1;
+    slot->state = RESOURCE_QUEUED;
+    slot->loaded = 0;
+    ++slot->serial;
+    slot->watch = -1;
+    if (resources.inotify >= 0) {
+        char dir[RESOURCE_PATH_SIZE];
+        const char *slash = strrchr(path, '/');
+        if (slash) {
+            memcpy(dir, path, slash - path);
+            dir[slash - path] = '\0';
+        } else {
+            strcpy(dir, ".");
+        }
+        /* Watching a directory twice gives back the same watch */
+        slot->watch = inotify_add_watch(resources.inotify, dir,
+            IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+    pthread_mutex_unlock(&resources.lock);
+    wakeLoader();
+    return slot - resources.slots + 1;
+}
+
+/*--------------------------------------------------------------------
+ * releaseResource
+ *
+ * Drop a reference to a resource, freeing it with the last one. The
+ * directory watch stays, since other resources may share it.
+ *--------------------------------------------------------------------*/
+void releaseResource(ResourceHandle handle)
+{
+    if (handle <= 0 || handle > MAX_RESOURCES) {
+        return;
+    }
+    pthread_mutex_lock(&resources.lock);
+    Resource *r = &resources.slots[handle - 1];
+    if (r->refs && --r->refs == 0) {
+        freeAsset(&r->current);
+        if (r->hasPending) {
+            freeAsset(&r->pending);
+            r->hasPending = 0;
+        }
+        r->state = RESOURCE_FREE;
+    }
+    pthread_mutex_unlock(&resources.lock);
+}
+
+/*--------------------------------------------------------------------
+ * atlasPage
+ *
+ * The atlas page a bitmap's pixels are on, or -1 if they aren't on
+ * any.
+ *--------------------------------------------------------------------*/
+int atlasPage(Bitmap bitmap)
+{
+    for (int i = 0; i < atlas.pageCount; ++i) {
+        const Bitmap *page = &atlas.pages[i];
+        if (bitmap.data >= page->data
+            && bitmap.data < page->data + page->stride * page->height) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int atlasFrameCompare(const void *a, const void *b)
+{
+    const AtlasFrame *frameA = a;
+    const AtlasFrame *frameB = b;
+    return frameB->bitmap->height - frameA->bitmap->height;
+}
+
+/*--------------------------------------------------------------------
+ * buildMips
+ *
+ * Fill in a bitmap's mip chain with bitmaps of the given tag, each
+ * level half the size of the one above, every pixel the average of
+ * the four it covers. Levels that would be less than a pixel across
+ * are left without data.
+ *--------------------------------------------------------------------*/
+void buildMips(Bitmap bitmap, Bitmap *mips, int tag)
+{
+    Bitmap src = bitmap;
+    for (int level = 0; level < MIP_LEVELS; ++level) {
+        int w = src.width / 2;
+        int h = src.height / 2;
+        if (w < 1 || h < 1) {
+            memset(&mips[level], 0, sizeof(Bitmap));
+            continue;
+        }
+        Bitmap mip = newBitmap(w, h, tag);
+        for (int y = 0; y < h; ++y) {
+            const unsigned int *row0 = src.data + 2 * y * src.stride;
+            const unsigned int *row1 = row0 + src.stride;
+            unsigned int *dest = mip.data + y * mip.stride;
+            for (int x = 0; x < w; ++x) {
+                unsigned int a = row0[2 * x], b = row0[2 * x + 1];
+                unsigned int c = row1[2 * x], d = row1[2 * x + 1];
+                /* Two channels at a time, each with room to carry */
+                unsigned int even = (a & 0x00ff00ff) + (b & 0x00ff00ff)
+                    + (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+                unsigned int odd = ((a >> 8) & 0x00ff00ff)
+                    + ((b >> 8) & 0x00ff00ff) + ((c >> 8) & 0x00ff00ff)
+                    + ((d >> 8) & 0x00ff00ff) + 0x00020002;
+                dest[x] = ((even >> 2) & 0x00ff00ff)
+                    | (((odd >> 2) & 0x00ff00ff) << 8);
+            }
+        }
+        mips[level] = mip;
+        src = mip;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * packResources
+ *
+ * Pack the frames of every loaded asset, other than those in the
+ * archive, into a new atlas, point them at their places in it, and
+ * free the old one, along with any bitmap of an asset's own that's now
+ * been copied. Repacking from scratch whenever an asset is swapped in
+ * also reclaims the space of those swapped out. Main thread only.
+ *--------------------------------------------------------------------*/
+void packResources()
+{
+    AtlasFrame frames[ATLAS_MAX_FRAMES];
+    int count = 0;
+    for (int i = 0; i < MAX_RESOURCES; ++i) {
+        Resource *r = &resources.slots[i];
+        Asset *asset = &r->current;
+        if (!r->refs || !asset->bitmap.data) {
+            continue;
+        }
+        int built = !asset->mips[0].data;
+        if (built) {
+            buildMips(asset->bitmap, asset->mips, MEM_ASSETS);
+        }
+        if (!inArchive(asset->bitmap)) {
+            frames[count].bitmap = &asset->bitmap;
+            frames[count].built = 0;
+            frames[count++].asset = asset;
+        }
+        for (int j = 0; j < POSE_COUNT && asset->poses[j].data; ++j) {
+            if (inArchive(asset->poses[j])) {
+                continue;
+            }
+            frames[count].bitmap = &asset->poses[j];
+            frames[count].built = 0;
+            frames[count++].asset = asset;
+        }
+        for (int j = 0; j < MIP_LEVELS && asset->mips[j].data; ++j) {
+            frames[count].bitmap = &asset->mips[j];
+            frames[count].built = built;
+            frames[count++].asset = asset;
+        }
+    }
+    qsort(frames, count, sizeof(AtlasFrame), atlasFrameCompare);
+    int heights[ATLAS_MAX_PAGES];
+    int pageCount = 0;
+    int page = 0, x = 0, shelfY = 0, shelfHeight = 0;
+    for (int i = 0; i < count; ++i) {
+        AtlasFrame *frame = &frames[i];
+        int w = frame->bitmap->width;
+        int h = frame->bitmap->height;
+        frame->page = -1;
+        if (w > ATLAS_PAGE_WIDTH || h > ATLAS_PAGE_HEIGHT) {
+            continue;
+        }
+        if (x + w > ATLAS_PAGE_WIDTH) {
+            shelfY += shelfHeight;
+            x = 0;
+            shelfHeight = 0;
+        }
+        if (shelfY + h > ATLAS_PAGE_HEIGHT) {
+            ++page;
+            x = shelfY = shelfHeight = 0;
+        }
+        if (!shelfHeight) {
+            shelfHeight = h;
+        }
+        frame->page = page;
+        frame->x = x;
+        frame->y = shelfY;
+        x += bitmapStride(w);
+        pageCount = page + 1;
+        heights[page] = shelfY + shelfHeight;
+    }
+    Atlas old = atlas;
+    atlas.pageCount = pageCount;
+    for (int i = 0; i < pageCount; ++i) {
+        atlas.pages[i] = newBitmap(ATLAS_PAGE_WIDTH, heights[i], MEM_ASSETS);
+    }
+    for (int i = 0; i < count; ++i) {
+        AtlasFrame *frame = &frames[i];
+        if (frame->page < 0) {
+            /* A mip that doesn't fit is one too big to be worth it */
+            if (frame->built) {
+                memFree(frame->bitmap->data);
+                memset(frame->bitmap, 0, sizeof(Bitmap));
+            }
+            continue;
+        }
+        Bitmap src = *frame->bitmap;
+        Bitmap dest = subBitmap(atlas.pages[frame->page], frame->x,
+            frame->y, src.width, src.height);
+        for (int y = 0; y < src.height; ++y) {
+            memcpy(dest.data + y * dest.stride, src.data + y * src.stride,
+                src.width * sizeof(int));
+        }
+        if (frame->built
+            || (frame->bitmap == &frame->asset->bitmap && frame->asset->owned)) {
+            memFree(src.data);
+        }
+        if (frame->bitmap == &frame->asset->bitmap) {
+            frame->asset->owned = 0;
+        }
+        *frame->bitmap = dest;
+    }
+    for (int i = 0; i < old.pageCount; ++i) {
+        memFree(old.pages[i].data);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * swapPending, swapResources
+ *
+ * Swap in whatever the loader has finished since the last frame, and
+ * return the number swapped. swapPending is called with the lock held.
+ * swapResources doesn't wait for the lock if the loader has it, and
+ * leaves the swap for the next frame instead. Either way, the atlas is
+ * repacked after.
+ *--------------------------------------------------------------------*/
+int swapPending()
+{
+    int swapped = 0;
+    for (int i = 0; i < MAX_RESOURCES; ++i) {
+        Resource *r = &resources.slots[i];
+        if (r->hasPending) {
+            freeAsset(&r->current);
+            r->current = r->pending;
+            r->hasPending = 0;
+            ++swapped;
+        }
+    }
+    return swapped;
+}
+
+int swapResources()
+{
+    if (pthread_mutex_trylock(&resources.lock) != 0) {
+        return 0;
+    }
+    int swapped = swapPending();
+    pthread_mutex_unlock(&resources.lock);
+    if (swapped) {
+        packResources();
+    }
+    return swapped;
+}
+
+/*--------------------------------------------------------------------
+ * waitForResources
+ *
+ * Block until nothing is queued or loading, and swap it all in. Return
+ * 0 if anything failed to load.
+ *--------------------------------------------------------------------*/
+int waitForResources()
+{
+    int ok = 1;
+    pthread_mutex_lock(&resources.lock);
+    for (int i = 0; i < MAX_RESOURCES; ++i) {
+        Resource *r = &resources.slots[i];
+        while (r->state == RESOURCE_QUEUED || r->state == RESOURCE_LOADING) {
+            pthread_cond_wait(&resources.loaded, &resources.lock);
+        }
+        if (r->refs && !r->loaded) {
+            ok = 0;
+        }
+    }
+    swapPending();
+    pthread_mutex_unlock(&resources.lock);
+    packResources();
+    return ok;
+}
+
+/*--------------------------------------------------------------------
+ * resourceAsset
+ *
+ * The asset a handle refers to, as of the last swap. Main thread only.
+ *--------------------------------------------------------------------*/
+const Asset *resourceAsset(ResourceHandle handle)
+{
+    static const Asset none;
+    if (handle <= 0 || handle > MAX_RESOURCES) {
+        return &none;
+    }
+    return &resources.slots[handle - 1].current;
+}
+
+/*--------------------------------------------------------------------
+ * vflipBitmap
+ *
+ * Return a vertically flipped bitmap, allocated from the frame arena.
+ *--------------------------------------------------------------------*/
+Bitmap vflipBitmap(Bitmap bitmap)
+{
+    int w = bitmap.width;
+    int h = bitmap.height;
+    Bitmap vflippedBitmap = frameBitmap(w, h);
+    unsigned int *dest = vflippedBitmap.data;
+    dest += (h - 1) * vflippedBitmap.stride;
+    for (int y = 0; y < h; ++y) {
+        memcpy(dest, bitmap.data + (y * bitmap.stride), w * sizeof(int));
+        dest -= vflippedBitmap.stride;
+    }
+    return vflippedBitmap;
+}
+
+/*--------------------------------------------------------------------
+ * rotateBitmap
+ *
+ * Return a bitmap rotated to any angle expressed in radians, allocated
+ * from the frame arena.
+ *--------------------------------------------------------------------*/
+Bitmap rotateBitmap(Bitmap bitmap, float angle)
+{
+    int w = bitmap.width;
+    int h = bitmap.height;
+    Bitmap rotatedBitmap = frameBitmap(w, h);
+    float angleSin = fastSin(angle);
+    float angleCos = fastCos(angle);
+    float cx = w / 2;
+    float cy = h / 2;
+    unsigned int *dest = rotatedBitmap.data;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            /* Get the rotated coordinates */
+            float rx = (((float)x - cx) * angleCos - ((float)y - cx) * angleSin) + cx;
+            float ry = (((float)x - cx) * angleSin + ((float)y - cy) * angleCos) + cy;
+            if (rx < 0 || ry < 0 || rx >= w - 1 || ry >= h - 1) {
+                continue;
+            }
+            /* Bilinear blending to smooth out edges */
+            int stride = bitmap.stride;
+            int x0 = fastFloor(rx), x1 = fastCeil(rx);
+            int y0 = fastFloor(ry), y1 = fastCeil(ry);
+            unsigned int tl = *(bitmap.data + (y0 * stride) + x0);
+            unsigned int tr = *(bitmap.data + (y0 * stride) + x1);
+            unsigned int bl = *(bitmap.data + (y1 * stride) + x0);
+            unsigned int br = *(bitmap.data + (y1 * stride) + x1);
+            float dx = rx - x0;
+            float dy = ry - y0;
+            float topA = (1 - dx) * (tl >> 24 & 255) + dx * (tr >> 24 & 255);
+            float topR = (1 - dx) * (tl >> 16 & 255) + dx * (tr >> 16 & 255);
+            float topG = (1 - dx) * (tl >> 8 & 255) + dx * (tr >> 8 & 255);
+            float topB = (1 - dx) * (tl >> 0 & 255) + dx * (tr >> 0 & 255);
+            float botA = (1 - dx) * (bl >> 24 & 255) + dx * (br >> 24 & 255);
+            float botR = (1 - dx) * (bl >> 16 & 255) + dx * (br >> 16 & 255);
+            float botG = (1 - dx) * (bl >> 8 & 255) + dx * (br >> 8 & 255);
+            float botB = (1 - dx) * (bl >> 0 & 255) + dx * (br >> 0 & 255);
+            float a = (1 - dy) * topA + dy * botA;
+            float r = (1 - dy) * topR + dy * botR;
+            float g = (1 - dy) * topG + dy * botG;
+            float b = (1 - dy) * topB + dy * botB;
+            unsigned int color = 0;
+            color |= fastRound(r) << 24;
+            color |= fastRound(g) << 16;
+            color |= fastRound(b) << 8;
+            color |= fastRound(a) << 0;
+            applyColor(color, dest + x);
+        }
+        dest += rotatedBitmap.stride;
+    }
+    return rotatedBitmap;
+}
+
+/*--------------------------------------------------------------------
+ * lerpPixel
+ *
+ * Blend two pixels, weighting the second by f out of 256, two
+ * channels at a time.
+ *--------------------------------------------------------------------*/
+unsigned int lerpPixel(unsigned int a, unsigned int b, unsigned int f)
+{
+    unsigned int even = ((a & 0x00ff00ff) * (256 - f)
+        + (b & 0x00ff00ff) * f) >> 8;
+    unsigned int odd = (((a >> 8) & 0x00ff00ff) * (256 - f)
+        + ((b >> 8) & 0x00ff00ff) * f) >> 8;
+    return (even & 0x00ff00ff) | ((odd & 0x00ff00ff) << 8);
+}
+
+/*--------------------------------------------------------------------
+ * lerpRow
+ *
+ * Blend the first width pixels of two rows into a third, as lerpPixel
+ * would, but a channel at a time. The whole BITMAP_ALIGN blocks go a
+ * block at a time, so the compiler vectorizes them with 16 bit
+ * multiplies, and the rest one channel at a time. Nothing past the
+ * width is read, since a row of an atlas frame runs on into its
+ * neighbours, and the last row of the page into the end of it.
+ *--------------------------------------------------------------------*/
+void lerpRow(int width, unsigned int *restrict dest,
+    const unsigned int *restrict a, const unsigned int *restrict b,
+    unsigned int f)
+{
+    unsigned char *restrict d = (unsigned char *)dest;
+    const unsigned char *restrict p = (const unsigned char *)a;
+    const unsigned char *restrict q = (const unsigned char *)b;
+    unsigned short weightA = 256 - f, weightB = f;
+    int bytes = width * (int)sizeof(int);
+    int blocks = bytes / BITMAP_ALIGN * BITMAP_ALIGN;
+    for (int block = 0; block < blocks; block += BITMAP_ALIGN) {
+        for (int x = block; x < block + BITMAP_ALIGN; ++x) {
+            d[x] = (unsigned short)(p[x] * weightA + q[x] * weightB) >> 8;
+        }
+    }
+    for (int x = blocks; x < bytes; ++x) {
+        d[x] = (unsigned short)(p[x] * weightA + q[x] * weightB) >> 8;
+    }
+}
+
+/* Where one pixel of a filtered bitmap samples from along an axis: the
+ * two source pixels around its center, and the weight of the second
+ * out of 256 */
+typedef struct filterTap {
+    int first, second;
+    unsigned int weight;
+} FilterTap;
+
+/*--------------------------------------------------------------------
+ * filterTaps
+ *
+ * Work out, in 16.16 fixed point, the taps for each of size pixels
+ * sampled from srcSize, into the frame arena.
+ *--------------------------------------------------------------------*/
+FilterTap *filterTaps(int srcSize, int size)
+{
+    FilterTap *taps = arenaAlloc(&frameArena, size * sizeof(FilterTap));
+    for (int i = 0; i < size; ++i) {
+        long long center = ((2LL * i + 1) * srcSize << 15) / size - 32768;
+        if (center < 0) {
+            center = 0;
+        }
+        taps[i].first = (int)(center >> 16);
+        taps[i].weight = (unsigned int)(center >> 8) & 0xff;
+        taps[i].second = taps[i].first + 1;
+        if (taps[i].second >= srcSize) {
+            taps[i].first = taps[i].second = srcSize - 1;
+            taps[i].weight = 0;
+        }
+    }
+    return taps;
+}
+
+/*--------------------------------------------------------------------
+ * scaleBitmap
+ *
+ * Return a bitmap scaled to any real number, allocated from the frame
+ * arena. Shrinking filters bilinearly from the smallest of the mips,
+ * if there are any, that's still no smaller than the result, so every
+ * source pixel counts. Anything else repeats pixels, stepping through
+ * the original in fixed point, and copies a row when it repeats the
+ * one above.
+ *--------------------------------------------------------------------*/
+Bitmap scaleBitmap(Bitmap bitmap, const Bitmap *mips, float scale)
+{
+    /* Original dimensions */
+    int w = bitmap.width;
+    int h = bitmap.height;
+    /* Scaled dimensions */
+    float wScaled = (float)w * scale;
+    float hScaled = (float)h * scale;
+    Bitmap scaledBitmap = frameBitmap((int)wScaled, (int)hScaled);
+    if (scaledBitmap.width <= 0 || scaledBitmap.height <= 0) {
+        return scaledBitmap;
+    }
+    unsigned int *dest = scaledBitmap.data;
+    if (scale < 1.0f) {
+        Bitmap src = bitmap;
+        for (int i = 0; mips && i < MIP_LEVELS && mips[i].data; ++i) {
+            if (mips[i].width < scaledBitmap.width
+                || mips[i].height < scaledBitmap.height) {
+                break;
+            }
+            src = mips[i];
+        }
+        if (src.width == scaledBitmap.width
+            && src.height == scaledBitmap.height) {
+            for (int y = 0; y < src.height; ++y) {
+                memcpy(dest + y * scaledBitmap.stride,
+                    src.data + y * src.stride, src.width * sizeof(int));
+            }
+            return scaledBitmap;
+        }
+        FilterTap *columns = filterTaps(src.width, scaledBitmap.width);
+        FilterTap *rows = filterTaps(src.height, scaledBitmap.height);
+        /* Blend the two source rows first, then across the blend */
+        unsigned int *blend = arenaAlloc(&frameArena,
+            bitmapStride(src.width) * sizeof(int));
+        for (int y = 0; y < scaledBitmap.height; ++y) {
+            const unsigned int *row0 = src.data + rows[y].first * src.stride;
+            const unsigned int *row1 = src.data + rows[y].second * src.stride;
+            lerpRow(src.width, blend, row0, row1, rows[y].weight);
+            for (int x = 0; x < scaledBitmap.width; ++x) {
+                const FilterTap *tap = &columns[x];
+                dest[x] = lerpPixel(blend[tap->first], blend[tap->second],
+                    tap->weight);
+            }
+            dest += scaledBitmap.stride;
+        }
+        return scaledBitmap;
+    }
+    /* Steps through the original per pixel of the enlarged one, in
+     * 16.16 fixed point, rounded down so they never reach the edge */
+    unsigned int stepX = ((unsigned int)w << 16) / scaledBitmap.width;
+    unsigned int stepY = ((unsigned int)h << 16) / scaledBitmap.height;
+    int lastRow = -1;
+    for (int y = 0; y < scaledBitmap.height; ++y) {
+        int row = (int)((y * stepY) >> 16);
+        if (row == lastRow) {
+            memcpy(dest, dest - scaledBitmap.stride,
+                scaledBitmap.width * sizeof(int));
+        } else {
+            const unsigned int *src = bitmap.data + row * bitmap.stride;
+            for (int x = 0; x < scaledBitmap.width; ++x) {
+                dest[x] = src[(x * stepX) >> 16];
+            }
+        }
+        lastRow = row;
+        dest += scaledBitmap.stride;
+    }
+    return scaledBitmap;
+}
+
+/*--------------------------------------------------------------------
+ * blitBitmap, blitBand
+ *
+ * Copy a bitmap to the display buffer with its top left corner at the
+ * given point, clipped to the display, drawing anything that isn't
+ * transparent or white as a black silhouette. blitBand only draws the
+ * rows from top up to but not including bottom.
+ *--------------------------------------------------------------------*/
+void blitBand(Bitmap bitmap, int x1, int y1, int top, int bottom)
+{
+    int x2 = x1 + bitmap.width;
+    int y2 = y1 + bitmap.height;
+    int xoff = 0, yoff = 0;
+    if (x1 < 0) {
+        xoff = -x1;
+        x1 = 0;
+    }
+    if (y1 < top) {
+        yoff = top - y1;
+        y1 = top;
+    }
+    if (x2 > display.width) {
+        x2 = display.width;
+    }
+    if (y2 > bottom) {
+        y2 = bottom;
+    }
+    int pitch = display.strideY / display.strideX;
+    unsigned int *src = bitmap.data + (yoff * bitmap.stride) + xoff;
+    unsigned int *dest = (unsigned int *)display.buffer + (y1 * pitch);
+    for (int y = y1; y < y2; ++y) {
+        for (int x = x1; x < x2; ++x) {
+            unsigned int color = *(src + (x - x1));
+            if (color != 0xffffffff && color != 0) {
+                color = 0x000000ff;
+            }
+            applyColor(color, dest + x);
+        }
+        src += bitmap.stride;
+        dest += pitch;
+    }
+}
+
+void blitBitmap(Bitmap bitmap, int x1, int y1)
+{
+    blitBand(bitmap, x1, y1, 0, display.height);
+}
+
+/*--------------------------------------------------------------------
+ * transformOffset, transformBitmap
+ *
+ * Scale and rotate a bitmap, flipping it if it faces left, into the
+ * frame arena. The result is centered where the original was, and
+ * transformOffset gives its size and offset without doing the work.
+ *--------------------------------------------------------------------*/
+void transformOffset(Bitmap bitmap, float scale, int *dx, int *dy,
+    int *width, int *height)
+{
+    *width = (int)((float)bitmap.width * scale);
+    *height = (int)((float)bitmap.height * scale);
+    *dx = (bitmap.width - *width) / 2;
+    *dy = (bitmap.height - *height) / 2;
+}
+
+Bitmap transformBitmap(Bitmap bitmap, const Bitmap *mips, float angle,
+    float scale)
+{
+    Bitmap scaledBitmap = scaleBitmap(bitmap, mips, scale);
+    Bitmap rotatedBitmap = rotateBitmap(scaledBitmap, angle);
+    if (fabs(angle - M_PI) < 0.1f) {
+        rotatedBitmap = vflipBitmap(rotatedBitmap);
+    }
+    return rotatedBitmap;
+}
+
+/*--------------------------------------------------------------------
+ * drawBitmap
+ *
+ * Copy an RGBA bitmap, rotated and scaled as needed, to the game's
+ * primary display buffer. Sprites are batched instead, through
+ * submitSprite.
+ *--------------------------------------------------------------------*/
+void drawBitmap(Bitmap bitmap, int x, int y, float angle, float scale)
+{
+    int dx, dy, width, height;
+    transformOffset(bitmap, scale, &dx, &dy, &width, &height);
+    blitBitmap(transformBitmap(bitmap, NULL, angle, scale), x + dx, y + dy);
+}
+
+/*--------------------------------------------------------------------
+ * initRipples
+ *
+ * Clear out any ripples. The first time, allocate each ripple's
+ * bitmap; they're reused from then on, since animateRipple redraws
+ * the whole bitmap every frame.
+ *--------------------------------------------------------------------*/
+void initRipples()
+{
+    for (int i = 0; i < 5; ++i) {
+        Ripple *ripple = &rippleArray[i];
+        if (!ripple->bitmap.data) {
+            ripple->bitmap = newBitmap(100, 100, MEM_RIPPLES);
+        }
+        ripple->active = 0;
+    }
+    rippleIndex = 0;
+}
+
+/*--------------------------------------------------------------------
+ * initRipple
+ *
+ * Initialize a ripple struct at a given location in an array.
+ *--------------------------------------------------------------------*/
+void initRipple(int x, int y)
+{
+    /* Wrap around the array and overwrite */
+    if (rippleIndex > 4) {
+        rippleIndex = 0;
+    }
+    Ripple *ripple = &rippleArray[rippleIndex];
+    ripple->radius = 20.0f;
+    ripple->alpha = 1.0f;
+    ripple->tileX = x;
+    ripple->tileY = y;
+    ripple->active = 1;
+    ++rippleIndex;
+}
+
+/*--------------------------------------------------------------------
+ * fillBitmap
+ *
+ * Fill a bitmap buffer with a given color.
+ *--------------------------------------------------------------------*/
+void fillBitmap(Bitmap *bitmap, int color)
+{
+    for (int y = 0; y < bitmap->height; ++y) {
+        for (int x = 0; x < bitmap->width; ++x) {
+            *(bitmap->data + (y * bitmap->stride) + x) = color;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * updateRipples
+ *
+ * Expand and fade each ripple by one simulation step. A ripple that
+ * reached its limit on the last step has been drawn at full size, so
+ * it's killed now instead.
+ *--------------------------------------------------------------------*/
+void updateRipples()
+{
+    for (int i = 0; i < 5; ++i) {
+        Ripple *ripple = &rippleArray[i];
+        if (!ripple->active) {
+            continue;
+        }
+        /* Kill the ripple if it gets too big */
+        if (ripple->radius >= (ripple->bitmap.width - 5) / 2) {
+            ripple->active = 0;
+            continue;
+        }
+        /* Expands each step */
+        ripple->radius += 1.0f * dtFrame * BASE_TICK_RATE;
+        /* Fades each step */
+        ripple->alpha -= 0.03f * dtFrame * BASE_TICK_RATE;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * animateRipple
+ *
+ * Draw a series of continuously expanding ripples, if they exist.
+ *--------------------------------------------------------------------*/
+void animateRipple()
+{
+    /* Iterate through the 4 ripples that can exist at a time */
+    for (int i = 0; i < 5; ++i) {
+        Ripple *ripple = &rippleArray[i];
+        /* Ripples are marked inactive at a certain radial limit */
+        if (!ripple->active) {
+            continue;
+        }
+        /* Clear the whole bitmap with full alpha transparency */
+        fillBitmap(&ripple->bitmap, 0);
+        /* Center point of the ripple circle */
+        float cx = ripple->bitmap.width / 2;
+        float cy = ripple->bitmap.height / 2;
+        /* Location of ripple on the screen */
+        int screenX = (ripple->tileX - view.camTileX + (DISPLAY_TW / 2)) * TILESIZE;
+        screenX -= cx;
+        screenX += TILESIZE / 2;
+        screenX -= view.camPixelX;
+        int screenY = (ripple->tileY - view.camTileY + (DISPLAY_TH / 2)) * TILESIZE;
+        screenY -= cy;
+        screenY += TILESIZE / 2;
+        screenY -= view.camPixelY;
+        /* For the gradient within the ripple */
+        float subAlpha = 1.0f;
+        /* Each ripple consists of 4.0 * 2 circles */
+        for (float rippleLine = 0.0f; rippleLine < 4.0f; rippleLine += 1.0f) {
+            /* Gradient within ripple */
+            unsigned int color = 0x6f6fbf << 8;
+            color |= (int)((ripple->alpha * 255) * subAlpha);
+            subAlpha -= 0.2f;
+            /* Inner and outer circle for bidirectional gradient */
+            for (float angle = 0.0f; angle < 2 * M_PI; angle += 0.01f) {
+                unsigned int *pixel;
+                int x, y;
+                float angleCos = fastCos(angle);
+                float angleSin = fastSin(angle);
+                /* The outermost line of the largest ripple reaches
+                 * just past the edge of the bitmap */
+                x = cx + ((ripple->radius + rippleLine) * angleCos);
+                y = cy + ((ripple->radius + rippleLine) * angleSin);
+                if (x < ripple->bitmap.width && y < ripple->bitmap.height) {
+                    pixel = ripple->bitmap.data;
+                    pixel += (y * ripple->bitmap.stride) + x;
+                    *pixel = color;
+                }
+                x = cx + ((ripple->radius - rippleLine) * angleCos);
+                y = cy + ((ripple->radius - rippleLine) * angleSin);
+                pixel = ripple->bitmap.data;
+                pixel += (y * ripple->bitmap.stride) + x;
+                *pixel = color;
+            }
+        }
+        /* Draw the ripple bitmap onto the game's display, clipped to
+         * the edges of the display */
+        int x1 = screenX < 0 ? -screenX : 0;
+        int y1 = screenY < 0 ? -screenY : 0;
+        int x2 = ripple->bitmap.width;
+        int y2 = ripple->bitmap.height;
+        if (screenX + x2 > display.width) x2 = display.width - screenX;
+        if (screenY + y2 > display.height) y2 = display.height - screenY;
+        int pitch = display.strideY / display.strideX;
+        unsigned int *src = ripple->bitmap.data;
+        src += (y1 * ripple->bitmap.stride);
+        unsigned int *dest = (unsigned int *)display.buffer;
+        dest += ((screenY + y1) * pitch) + screenX;
+        for (int y = y1; y < y2; ++y) {
+            for (int x = x1; x < x2; ++x) {
+                if (*(dest + x) != 0xeb9b34ff && *(dest + x) != 0x000000ff) {
+                    applyColor(*(src + x), dest + x);
+                }
+            }
+            src += ripple->bitmap.stride;
+            dest += pitch;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * initMap
+ *
+ * Initialize a tilemap with a random walk. Store the coordinates in
+ * an array in the order they are determined by the walk. For each
+ * coordinate pair, calculate a unique "flat" coordinate with (y *
+ * MAPWIDTH) + x. At the end, use this number to sort the array with
+ * the standard library's qsort.
+ *--------------------------------------------------------------------*/
+void initMap()
+{
+    int mapMinX = -(MAPWIDTH / 2);
+    int mapMaxX = MAPWIDTH / 2;
+    int mapMinY = -(MAPHEIGHT / 2);
+    int mapMaxY = MAPHEIGHT / 2;
+    int x = 0;
+    int y = 0;
+    int r1 = 0;
+    int r2 = 0;
+    memFree(tileArray);
+    tileArray = memAlloc(mapLength * sizeof(Tile), MEM_MAP);
+    Tile *tile = tileArray;
+    int i = 0;
+    while (tile - tileArray < mapLength) {
+        int repeat = 0;
+        /* Check if the current tile proposal is a repeat */
+        for (Tile *p = tileArray; p < tile; ++p) {
+            if (p->x == x && p->y == y) {
+                repeat = 1;
+                break;
+            }
+        }
+        /* If not, push it onto the array and store a flattened
+         * version of it for a sorted index */
+        if (!repeat) {
+            tile->x = x;
+            tile->y = y;
+            tile->flatCoord = (y * MAPWIDTH) + x;
+            ++tile;
+        }
+        /* Change the directional bias every 20 moves */
+        if (i++ % 20 == 0) {
+            r2 = rand() % 4;
+        }
+        /* r1 can be one of 4 directions, or a 5th number that hands
+         * the move to the bias r2 */
+        r1 = rand() % 5;
+        if (r1 == 0 || (r1 == 4 && r2 == 0)) {
+            ++x;
+        } else if (r1 == 1 || (r1 == 4 && r2 == 1)) {
+            --x;
+        } else if (r1 == 2 || (r1 == 4 && r2 == 2)) {
+            ++y;
+        } else if (r1 == 3 || (r1 == 4 && r2 == 3)) {
+            --y;
+        }
+        /* Don't walk past the boundaries */
+        if (x > mapMaxX) x = mapMaxX;
+        if (y > mapMaxY) y = mapMaxY;
+        if (x < mapMinX) x = mapMaxX;
+        if (y < mapMinY) y = mapMaxY;
+    }
+    /* Sort the array by flatCoord for faster access with bsearch */
+    qsort(tileArray, mapLength, sizeof(Tile), tileCompare);
+}
+
+/*--------------------------------------------------------------------
+ * inputPush, inputPop
+ *
+ * Add a key event to the input queue, or take the oldest one off it.
+ * A full queue drops new events rather than block the backend.
+ *--------------------------------------------------------------------*/
+void inputPush(int key, int down, unsigned long long time)
+{
+    InputQueue *queue = &inputQueue;
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head - tail >= INPUT_QUEUE_SIZE) {
+        ++queue->dropped;
+        return;
+    }
+    InputEvent *event = &queue->events[head & (INPUT_QUEUE_SIZE - 1)];
+    event->time = time;
+    event->key = key;
+    event->down = down;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+int inputPop(InputEvent *event)
+{
+    InputQueue *queue = &inputQueue;
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail == head) {
+        return 0;
+    }
+    *event = queue->events[tail & (INPUT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * sdlInit
+ *
+ * Initialize SDL and create the window, renderer, and streaming
+ * texture that the display buffer is uploaded to each frame, and find
+ * out the display's refresh rate if SDL knows it. Return 0 on failure.
+ *--------------------------------------------------------------------*/
+int sdlInit()
+{
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+        return 0;
+    }
+    display.window = SDL_CreateWindow(
+        "Kujira",
+        SDL_WINDOWPOS_CENTERED,
+        SDL_WINDOWPOS_CENTERED,
+        display.width, display.height,
+        SDL_WINDOW_RESIZABLE);
+    if (!display.window) {
+        fprintf(stderr, "SDL_CreateWindow: %s\n", SDL_GetError());
+        return 0;
+    }
+    Uint32 flags = SDL_RENDERER_ACCELERATED;
+    if (pacer.vsync) {
+        flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    display.renderer = SDL_CreateRenderer(display.window, -1, flags);
+    if (!display.renderer) {
+        fprintf(stderr, "SDL_CreateRenderer: %s\n", SDL_GetError());
+        return 0;
+    }
+    display.texture = SDL_CreateTexture(display.renderer,
+        SDL_PIXELFORMAT_RGBA8888,
+        SDL_TEXTUREACCESS_STREAMING,
+        display.width, display.height);
+    SDL_RenderSetLogicalSize(
+        display.renderer,
+        display.width, display.height);
+    SDL_DisplayMode mode;
+    if (SDL_GetWindowDisplayMode(display.window, &mode) == 0) {
+        display.refreshRate = mode.refresh_rate;
+    }
+    return 1;
+}
+
+/* The scancode of each of inputKeys */
+const SDL_Scancode sdlScancodes[INPUT_KEY_COUNT] = {
+    SDL_SCANCODE_UP, SDL_SCANCODE_DOWN, SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT,
+    SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_Q, SDL_SCANCODE_R
+};
+
+/*--------------------------------------------------------------------
+ * sdlGetInput
+ *
+ * Drain SDL's event queue, passing presses and releases of the game's
+ * keys on to the input queue. SDL stamps events in milliseconds since
+ * it started, which is turned back into the monotonic clock by how
+ * long ago that was. Draining the queue also means that a wait only
+ * wakes for new events, and a window that needs repainting gets a
+ * frame even when the game is idle.
+ *--------------------------------------------------------------------*/
+void sdlGetInput()
+{
+    unsigned long long now = monotonicNs();
+    Uint32 ticks = SDL_GetTicks();
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) {
+            running = 0;
+        } else if (event.type == SDL_WINDOWEVENT
+            && (event.window.event == SDL_WINDOWEVENT_EXPOSED
+            || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+            idle.resting = 0;
+        } else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+            && !event.key.repeat) {
+            int down = event.type == SDL_KEYDOWN;
+#ifdef KUJIRA_PROFILE
+            /* The overlay toggle isn't game input, so it stays out of
+             * Input and out of recordings */
+            if (event.key.keysym.scancode == SDL_SCANCODE_F3 && down) {
+                profiler.overlay = !profiler.overlay;
+            }
+#endif
+            unsigned long long ago = (ticks - event.key.timestamp) * 1000000ull;
+            for (int key = 0; key < INPUT_KEY_COUNT; ++key) {
+                if (event.key.keysym.scancode == sdlScancodes[key]) {
+                    inputPush(key, down, ago < now ? now - ago : now);
+                }
+            }
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * sdlBlit
+ *
+ * Call SDL functions to blit the display buffer onto the screen.
+ *--------------------------------------------------------------------*/
+void sdlBlit()
+{
+    SDL_RenderClear(display.renderer);
+    SDL_UpdateTexture(
+        display.texture,
+        NULL,
+        display.buffer,
+        display.strideY);
+    SDL_RenderCopy(
+        display.renderer,
+        display.texture,
+        NULL, NULL);
+    SDL_RenderPresent(display.renderer);
+}
+
+/*--------------------------------------------------------------------
+ * sdlWait
+ *
+ * Block until there's an event or the timeout passes. The event is
+ * left in the queue for the next sdlGetInput.
+ *--------------------------------------------------------------------*/
+void sdlWait(int ms)
+{
+    SDL_WaitEventTimeout(NULL, ms);
+}
+
+/*--------------------------------------------------------------------
+ * headlessInit, headlessGetInput, headlessBlit, headlessWait
+ *
+ * The headless backend never touches SDL video. Frames are still
+ * rendered into the display buffer, but they go nowhere, and there is
+ * no keyboard, so input has to come from a script.
+ *--------------------------------------------------------------------*/
+int headlessInit()
+{
+    return 1;
+}
+
+void headlessGetInput()
+{
+}
+
+void headlessBlit()
+{
+}
+
+void headlessWait(int ms)
+{
+    (void)ms;
+}
+
+const Backend sdlBackend = {
+    "sdl", sdlInit, sdlGetInput, sdlBlit, sdlWait};
+const Backend headlessBackend = {
+    "headless", headlessInit, headlessGetInput, headlessBlit, headlessWait};
+
+/*--------------------------------------------------------------------
+ * blitDisplay
+ *
+ * Hand the finished display buffer to the backend.
+ *--------------------------------------------------------------------*/
+void blitDisplay()
+{
+    display.backend->blit();
+}
+
+/*--------------------------------------------------------------------
+ * initDisplay
+ *
+ * Allocate the display buffer and initialize the given backend.
+ *--------------------------------------------------------------------*/
+void initDisplay(const Backend *backend)
+{
+    display.backend = backend;
+    display.width = DISPLAY_PW;
+    display.height = DISPLAY_PH;
+    display.strideX = sizeof(int);
+    display.strideY = bitmapStride(display.width) * display.strideX;
+    display.buffer = memAllocAligned(
+        display.strideY * display.height, BITMAP_ALIGN, MEM_FRAMEBUFFERS);
+    if (!backend->init()) {
+        exit(1);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * drawRect
+ *
+ * Draw a rectangle to the game's display buffer.
+ *--------------------------------------------------------------------*/
+void drawRect(Bitmap buffer, int x, int y, int w, int h, unsigned int color)
+{
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w >= DISPLAY_PW) w = DISPLAY_PW - x;
+    if (y + h >= DISPLAY_PH) h = DISPLAY_PH - y;
+    unsigned int *pixel = buffer.data;
+    pixel += y * buffer.stride;
+    pixel += x;
+    for (int rectY = 0; rectY < h; ++rectY) {
+        for (int rectX = 0; rectX < w; ++rectX) {
+            applyColor(color, pixel + rectX);
+        }
+        pixel += buffer.stride;
+    }
+}
+
+#ifdef KUJIRA_PROFILE
+/* 3x5 pixel font for the overlay. Each glyph is 15 bits, three per
+ * row, top row in the high bits. */
+const unsigned short fontGlyphs[128] = {
+    ['0'] = 0x7b6f, ['1'] = 0x2c97, ['2'] = 0x73e7, ['3'] = 0x73cf,
+    ['4'] = 0x5bc9, ['5'] = 0x79cf, ['6'] = 0x79ef, ['7'] = 0x7249,
+    ['8'] = 0x7bef, ['9'] = 0x7bcf, ['A'] = 0x2bed, ['B'] = 0x6bae,
+    ['C'] = 0x3923, ['D'] = 0x6b6e, ['E'] = 0x79a7, ['F'] = 0x79a4,
+    ['G'] = 0x396b, ['H'] = 0x5bed, ['I'] = 0x7497, ['J'] = 0x126a,
+    ['K'] = 0x5bad, ['L'] = 0x4927, ['M'] = 0x5fed, ['N'] = 0x6b6d,
+    ['O'] = 0x2b6a, ['P'] = 0x6ba4, ['Q'] = 0x2b73, ['R'] = 0x6bad,
+    ['S'] = 0x388e, ['T'] = 0x7492, ['U'] = 0x5b6f, ['V'] = 0x5b6a,
+    ['W'] = 0x5bfd, ['X'] = 0x5aad, ['Y'] = 0x5a92, ['Z'] = 0x72a7,
+    ['.'] = 0x0002, ['-'] = 0x01c0, [':'] = 0x0410, ['/'] = 0x12a4,
+    ['%'] = 0x52a5
+};
+
+/*--------------------------------------------------------------------
+ * drawText
+ *
+ * Draw a string with the overlay font, each font pixel scaled up to a
+ * square of the given size. Lowercase is drawn as uppercase.
+ *--------------------------------------------------------------------*/
+void drawText(Bitmap buffer, int x, int y, int size, const char *text,
+    unsigned int color)
+{
+    for (; *text; ++text, x += 4 * size) {
+        int c = *text;
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        unsigned short glyph = (c > 0 && c < 128) ? fontGlyphs[c] : 0;
+        for (int row = 0; row < 5; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                if (glyph & (1 << (14 - (row * 3 + col)))) {
+                    drawRect(buffer, x + col * size, y + row * size,
+                        size, size, color);
+                }
+            }
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * drawProfileOverlay
+ *
+ * Draw the per-stage timings over the top left of the display.
+ *--------------------------------------------------------------------*/
+void drawProfileOverlay()
+{
+    Bitmap screen;
+    screen.data = (unsigned int *)display.buffer;
+    screen.width = display.width;
+    screen.height = display.height;
+    screen.stride = display.strideY / display.strideX;
+    int size = 2;
+    int lineHeight = 7 * size;
+    drawRect(screen, 4, 4, 4 * size * 34 + 8,
+        lineHeight * (STAGE_COUNT + 4) + 8, 0x000000b0);
+    char line[64];
+    int y = 8;
+    drawText(screen, 8, y, size, "STAGE MS     P50    P99    MAX",
+        0xffff00ff);
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const StageStats *stats = &profiler.stages[i];
+        y += lineHeight;
+        snprintf(line, sizeof(line), "%-8s %6.2f %6.2f %6.2f",
+            stageNames[i],
+            profilePercentile(stats, 0.50f) / 1e6,
+            profilePercentile(stats, 0.99f) / 1e6,
+            profileMax(stats) / 1e6);
+        drawText(screen, 8, y, size, line, 0xffffffff);
+    }
+    y += lineHeight;
+    snprintf(line, sizeof(line), "%-8s %6.2f %6.2f %6.2f", "INPUT",
+        profilePercentile(&profiler.inputToPresent, 0.50f) / 1e6,
+        profilePercentile(&profiler.inputToPresent, 0.99f) / 1e6,
+        profileMax(&profiler.inputToPresent) / 1e6);
+    drawText(screen, 8, y, size, line, 0xffffffff);
+    y += lineHeight;
+    snprintf(line, sizeof(line), "MISSED %ld/%ld  JITTER %.2f",
+        pacer.missed, pacer.frames,
+        pacer.frames ? pacer.errorSum / pacer.frames / 1e6 : 0.0);
+    drawText(screen, 8, y, size, line, 0xffffffff);
+    y += lineHeight;
+    snprintf(line, sizeof(line), "MEM KB %zu  PEAK %zu",
+        memStats.live / 1024, memStats.peak / 1024);
+    drawText(screen, 8, y, size, line, 0xffffffff);
+}
+#endif
+
+/*--------------------------------------------------------------------
+ * drawMap
+ *
+ * Draw a new portion of the map onto the newer of two buffers
+ * whenever the camera scrolls. The actual displaying of the buffer is
+ * accomplished by just copying the contents of these two buffers to
+ * the game's display buffer, so that the expensive calculations in
+ * this function don't need to be performed during most frames.
+ *--------------------------------------------------------------------*/
+void drawMap()
+{
+    PROFILE_BEGIN(STAGE_DRAW_MAP);
+    /* We want to scroll into the next portion of the map when the
+     * player steps into it, but we also don't want to recalculate the
+     * visible map on each frame, so we need to keep two buffers: the
+     * current (old) and the one to be scrolled into (new). The new
+     * becomes the old whenever this function is called, which is only
+     * when it's time to scroll. */
+    memcpy(
+        bgBufferOld.data,
+        bgBufferNew.data,
+        bgBufferNew.stride * bgBufferNew.height * sizeof(int));
+    fillBitmap(&bgBufferNew, 0xeb9b34ff); // gold
+    int pixelX = 0;
+    int pixelY = 0;
+    int centerX = DISPLAY_TW / 2;
+    int centerY = DISPLAY_TH / 2;
+    /* Draw tiles from the map with the camera as center point */
+    for (int y = cam.destTileY - centerY; y < cam.destTileY + centerY + 2; ++y) {
+        for (int x = cam.destTileX - centerX; x < cam.destTileX + centerX + 1; ++x) {
+            Tile tile;
+            tile.x = x;
+            tile.y = y;
+            tile.flatCoord = (tile.y * MAPWIDTH) + tile.x;
+            if (bsearch(&tile, tileArray, mapLength, sizeof(Tile), tileCompare)) {
+                unsigned int color = 0x4f4f9fff; // blue
+                /* Tile's shadow */
+                drawRect(
+                    bgBufferNew,
+                    pixelX,
+                    pixelY,
+                    TILESIZE,
+                    TILESIZE,
+                    0x000000ff);
+                /* Actual tile */
+                drawRect(
+                    bgBufferNew,
+                    pixelX - 2,
+                    pixelY - 2,
+                    TILESIZE - 2,
+                    TILESIZE - 2,
+                    color);
+            }
+            pixelX += TILESIZE;
+        }
+        pixelX = 0;
+        pixelY += TILESIZE;
+    }
+    PROFILE_END(STAGE_DRAW_MAP);
+}
+
+/*--------------------------------------------------------------------
+ * initBackground
+ *
+ * Allocate the two display-sized buffers that drawMap draws into and
+ * drawBackground composes from. They have the display's stride, so
+ * that a whole buffer can be copied to it at once.
+ *--------------------------------------------------------------------*/
+void initBackground()
+{
+    bgBufferOld = newBitmap(display.width, display.height, MEM_FRAMEBUFFERS);
+    bgBufferNew = newBitmap(display.width, display.height, MEM_FRAMEBUFFERS);
+    assert(bgBufferNew.stride * display.strideX == display.strideY);
+}
+
+/*--------------------------------------------------------------------
+ * drawBackground
+ *
+ * This function, which, unlike drawMap, is called every frame,
  * actually composes the displayed map by copying the background
  * buffers to the display buffer. If the camera is in the middle of
  * scrolling, then a composite of the two buffers is put together.
  * Otherwise, the latest contents of the camera's updated view are
  * just memcpy'd.
  *--------------------------------------------------------------------*/
-void drawBackground()
+void drawBackground()
+{
+    int minX = (int)view.camPixelX;
+    int maxX = minX + DISPLAY_PW;
+    int minY = (int)view.camPixelY;
+    int maxY = minY + DISPLAY_PH;
+    /* If we're in the middle of a scroll */
+    if (cam.tileX != cam.destTileX || cam.tileY != cam.destTileY) {
+        for (int y = minY; y < maxY; ++y) {
+            for (int x = minX; x < maxX; ++x) {
+                unsigned int *src;
+                int newX = x;
+                int newY = y;
+                /* If x or y are negative, or if they're greater than
+                 * the pixel width of the screen, then they should
+                 * actually refer to a position on the new buffer.
+                 * Otherwise, this portion of the screen should still
+                 * be showing the old buffer. */
+                if (x < 0) {
+                    src = bgBufferNew.data;
+                    newX = x + SCROLL_PW;
+                } else if (x >= DISPLAY_PW) {
+                    src = bgBufferNew.data;
+                    newX = x - SCROLL_PW;
+                } else if (y < 0) {
+                    src = bgBufferNew.data;
+                    newY = y + SCROLL_PH;
+                } else if (y >= DISPLAY_PH) {
+                    src = bgBufferNew.data;
+                    newY = y - SCROLL_PH;
+                } else {
+                    src = bgBufferOld.data;
+                }
+                src += (newY * bgBufferNew.stride) + newX;
+                unsigned int *dest = (unsigned int *)display.buffer;
+                dest += ((y - minY) * bgBufferNew.stride) + (x - minX);
+                *dest = *src;
+            }
+        }
+    /* No scrolling happening, so just copy the latest buffer */
+    } else {
+        memcpy(
+            display.buffer,
+            bgBufferNew.data,
+            display.strideY * display.height);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * loadScript
+ *
+ * Read an input script. Each line holds a frame count followed by the
+ * names of the keys to hold down for that many frames, e.g.
+ *
+ *     60 right
+ *     20 up z
+ *     30
+ *
+ * Blank lines and lines starting with '#' are ignored. Return 0 if the
+ * script can't be read.
+ *--------------------------------------------------------------------*/
+int loadScript(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        perror(filename);
+        return 0;
+    }
+    char line[256];
+    int lineNumber = 0;
+    int capacity = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        ++lineNumber;
+        char *token = strtok(line, " \t\r\n");
+        if (!token || token[0] == '#') {
+            continue;
+        }
+        if (inputScript.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ScriptStep *steps = memAlloc(capacity * sizeof(ScriptStep),
+                MEM_INPUT);
+            if (inputScript.steps) {
+                memcpy(steps, inputScript.steps,
+                    inputScript.count * sizeof(ScriptStep));
+            }
+            memFree(inputScript.steps);
+            inputScript.steps = steps;
+        }
+        ScriptStep *step = &inputScript.steps[inputScript.count++];
+        memset(step, 0, sizeof(ScriptStep));
+        step->frames = atoi(token);
+        while ((token = strtok(NULL, " \t\r\n"))) {
+            int k;
+            for (k = 0; k < INPUT_KEY_COUNT; ++k) {
+                if (strcmp(token, inputKeys[k].name) == 0) {
+                    *(int *)((char *)&step->input + inputKeys[k].offset) = 1;
+                    break;
+                }
+            }
+            if (k == INPUT_KEY_COUNT) {
+                fprintf(stderr, "%s:%d: unknown key '%s'\n",
+                    filename, lineNumber, token);
+                fclose(fp);
+                return 0;
+            }
+        }
+    }
+    fclose(fp);
+    if (inputScript.count > 0) {
+        inputScript.framesLeft = inputScript.steps[0].frames;
+    }
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * nextScriptInput
+ *
+ * Copy the scripted input for the current frame into *input. Return 0
+ * once the script has run out.
+ *--------------------------------------------------------------------*/
+int nextScriptInput(Input *input)
+{
+    while (inputScript.index < inputScript.count
+        && inputScript.framesLeft <= 0) {
+        if (++inputScript.index < inputScript.count) {
+            inputScript.framesLeft = inputScript.steps[inputScript.index].frames;
+        }
+    }
+    if (inputScript.index >= inputScript.count) {
+        return 0;
+    }
+    *input = inputScript.steps[inputScript.index].input;
+    --inputScript.framesLeft;
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * packInput, unpackInput
+ *
+ * Convert between the Input struct and the single word per step
+ * that's stored in a recording.
+ *--------------------------------------------------------------------*/
+unsigned short packInput(const Input *input)
+{
+    unsigned short word = 0;
+    for (int k = 0; k < INPUT_KEY_COUNT; ++k) {
+        if (*(const int *)((const char *)input + inputKeys[k].offset)) {
+            word |= 1 << k;
+        }
+    }
+    return word;
+}
+
+void unpackInput(unsigned short word, Input *input)
+{
+    for (int k = 0; k < INPUT_KEY_COUNT; ++k) {
+        *(int *)((char *)input + inputKeys[k].offset) = (word >> k) & 1;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * startRecording
+ *
+ * Open a recording and write its header. The frames are appended by
+ * getInput as they happen. Return 0 on failure.
+ *--------------------------------------------------------------------*/
+int startRecording(const char *filename, unsigned int seed)
+{
+    ReplayHeader header;
+    memcpy(header.magic, REPLAY_MAGIC, 4);
+    header.version = REPLAY_VERSION;
+    header.seed = seed;
+    header.dtFrame = dtFrame;
+    replay.recordFile = fopen(filename, "wb");
+    if (!replay.recordFile) {
+        perror(filename);
+        return 0;
+    }
+    fwrite(&header, sizeof(header), 1, replay.recordFile);
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * loadReplay
+ *
+ * Read a whole recording into memory so that playback never touches
+ * the disk. The recording's seed and frame time are returned through
+ * the pointers. Return 0 on failure.
+ *--------------------------------------------------------------------*/
+int loadReplay(const char *filename, unsigned int *seed, float *dt)
+{
+    ReplayHeader header;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        perror(filename);
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, REPLAY_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a recording\n", filename);
+        fclose(fp);
+        return 0;
+    }
+    if (header.version != REPLAY_VERSION) {
+        fprintf(stderr, "%s: recording is version %d, not %d\n", filename,
+            header.version, REPLAY_VERSION);
+        fclose(fp);
+        return 0;
+    }
+    if (!(header.dtFrame >= 1.0f / MAX_TICK_RATE
+        && header.dtFrame <= 1.0f / MIN_TICK_RATE)) {
+        fprintf(stderr, "%s: step out of range\n", filename);
+        fclose(fp);
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long bytes = ftell(fp) - sizeof(header);
+    fseek(fp, sizeof(header), SEEK_SET);
+    replay.count = bytes / sizeof(unsigned short);
+    replay.frames = memAlloc(replay.count * sizeof(unsigned short) + 1,
+        MEM_INPUT);
+    replay.count = fread(replay.frames, sizeof(unsigned short), replay.count, fp);
+    fclose(fp);
+    *seed = header.seed;
+    *dt = header.dtFrame;
+    return 1;
+}
+
+/*--------------------------------------------------------------------
+ * getInput
+ *
+ * Have the backend queue up whatever input has arrived since the last
+ * frame.
+ *--------------------------------------------------------------------*/
+void getInput()
+{
+#ifdef KUJIRA_PROFILE
+    profiler.frameStart = monotonicNs();
+#endif
+    display.backend->getInput();
+}
+
+/*--------------------------------------------------------------------
+ * takeQueuedInput
+ *
+ * Take every queued event and apply it to the held keys. A key that
+ * was pressed is down for this step even if it has already been
+ * released again, so that no tap is lost; it's up from the next step.
+ *--------------------------------------------------------------------*/
+void takeQueuedInput(Input *input)
+{
+    *input = heldInput;
+    InputEvent event;
+    while (inputPop(&event)) {
+        int *key = (int *)((char *)&heldInput + inputKeys[event.key].offset);
+        *key = event.down;
+        if (event.down) {
+            *(int *)((char *)input + inputKeys[event.key].offset) = 1;
+#ifdef KUJIRA_PROFILE
+            if (!profiler.eventTime || event.time < profiler.eventTime) {
+                profiler.eventTime = event.time;
+            }
+#endif
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * stepInput
+ *
+ * Set up the input for one simulation step: the queued key events,
+ * unless a replay, a benchmark scenario, or an input script overrides
+ * it. A replay ends the run when it runs out, and so does a script in
+ * a headless run with no frame limit; the step is then abandoned.
+ * Finally, append the step's input to the recording. Recording steps
+ * rather than frames is what makes a replay, which runs in lockstep,
+ * reproduce a live run.
+ *--------------------------------------------------------------------*/
+void stepInput()
+{
+    takeQueuedInput(&newInput);
+    if (replay.frames) {
+        /* Still let the player quit out of a replay */
+        int quit = newInput.key_q;
+        if (replay.index >= replay.count) {
+            running = 0;
+            return;
+        }
+        unpackInput(replay.frames[replay.index++], &newInput);
+        newInput.key_q |= quit;
+    } else if (scenario) {
+        scenario->drive(stepCount, &newInput);
+    } else if (inputScript.steps && !nextScriptInput(&newInput)
+        && options.headless && !options.frameLimit) {
+        running = 0;
+        return;
+    }
+    if (replay.recordFile) {
+        unsigned short word = packInput(&newInput);
+        fwrite(&word, sizeof(word), 1, replay.recordFile);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * updateCamera
+ *
+ * When the player comes close to the edge of the screen, scroll the
+ * camera's position in the direction corresponding to the edge. Only
+ * allow this to happen if the camera is not already scrolling.
+ * TODO: I'm still unsure about this movement. It offers a certain
+ * aesthetic, but there's the problem of the player disappearing off
+ * the screen if they try to go off screen in a different direction
+ * during a scroll.
+ *--------------------------------------------------------------------*/
+void updateCamera()
+{
+    if (cam.destTileX == cam.tileX && cam.destTileY == cam.tileY) {
+        int horizEdge = (DISPLAY_TW / 2) - 2;
+        int vertEdge = (DISPLAY_TH / 2) - 2;
+        if (player.x - cam.tileX < -horizEdge) {
+            cam.accelX = -SCROLL_ACCEL_X;
+            cam.destTileX = cam.tileX - SCROLL_TW;
+            drawMap();
+        } else if (player.x - cam.tileX >= horizEdge) {
+            cam.accelX = SCROLL_ACCEL_X;
+            cam.destTileX = cam.tileX + SCROLL_TW;
+            drawMap();
+        } else if (player.y - cam.tileY < -vertEdge) {
+            cam.accelY = -SCROLL_ACCEL_Y;
+            cam.destTileY = cam.tileY - SCROLL_TH;
+            drawMap();
+        } else if (player.y - cam.tileY >= vertEdge) {
+            cam.accelY = SCROLL_ACCEL_Y;
+            cam.destTileY = cam.tileY + SCROLL_TH;
+            drawMap();
+        }
+    }
+    if (cam.destTileX != cam.tileX) {
+        if (cam.pixelX > SCROLL_PW / 2
+            || cam.pixelX < -SCROLL_PW / 2) {
+            cam.velocityX -= cam.accelX * dtFrame;
+        } else {
+            cam.velocityX += cam.accelX * dtFrame;
+        }
+        cam.pixelX += cam.velocityX * dtFrame;
+        if (cam.pixelX >= SCROLL_PW) {
+            cam.velocityX = 0;
+            cam.pixelX = 0;
+            cam.tileX += SCROLL_TW;
+        } else if (cam.pixelX < -SCROLL_PW) {
+            cam.velocityX = 0;
+            cam.pixelX = 0;
+            cam.tileX -= SCROLL_TW;
+        }
+    } else if (cam.destTileY != cam.tileY) {
+        if (cam.pixelY > (SCROLL_TH * TILESIZE) / 2
+            || cam.pixelY < -SCROLL_PH / 2) {
+            cam.velocityY -= cam.accelY * dtFrame;
+        } else {
+            cam.velocityY += cam.accelY * dtFrame;
+        }
+        cam.pixelY += cam.velocityY * dtFrame;
+        if (cam.pixelY >= SCROLL_PH) {
+            cam.velocityY = 0;
+            cam.pixelY = 0;
+            cam.tileY += SCROLL_TH;
+        } else if (cam.pixelY < -SCROLL_PH) {
+            cam.velocityY = 0;
+            cam.pixelY = 0;
+            cam.tileY -= SCROLL_TH;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * turnStep, hopGrowth, tileLanding
+ *
+ * The rules of a tile step, shared by the player and the entities.
+ * turnStep turns an angle toward where it's headed by dt's worth of
+ * turning, wrapping around a whole turn, and snaps to it once they're
+ * in the same radian or the turn would reach it, either way round.
+ * hopGrowth is how much a hop grows a sprite over dt at a speed.
+ * tileLanding is 1 or -1 once a move along an axis has gone a whole
+ * tile forward or back, and 0 until then.
+ *--------------------------------------------------------------------*/
+float turnStep(float angle, float destAngle, float dt)
+{
+    float turn = 0.4f * dt * BASE_TICK_RATE;
+    float distance = destAngle - angle;
+    if (distance < 0) {
+        distance = -distance;
+    }
+    /* A turn that would reach where it's headed, or carry past it,
+     * stops there instead, however long the step. Otherwise a long
+     * enough step overshoots every time and never settles. */
+    float around = 2 * M_PI - distance;
+    if ((int)destAngle == (int)angle || distance <= turn || around <= turn) {
+        return destAngle;
+    }
+    angle += destAngle - angle >= 0 ? turn : -turn;
+    if (angle > 2 * M_PI) {
+        angle = 0.0f;
+    } else if (angle < 0.0f) {
+        angle = 2 * M_PI;
+    }
+    return angle;
+}
+
+float hopGrowth(float speed, float dt)
+{
+    return speed * 0.005f * dt;
+}
+
+int tileLanding(float pixel)
+{
+    return (pixel >= TILESIZE) - (pixel < -TILESIZE);
+}
+
+/*--------------------------------------------------------------------
+ * updatePlayer
+ *
+ * Handle the movement, rotation, and scaling of the player. Also
+ * initialize water ripples.
+ *--------------------------------------------------------------------*/
+void updatePlayer()
+{
+    /* The player always moves one tile at a time */
+    float accel = HOP_ACCEL;
+    /* Only check for input if no movement is currently underway. */
+    if (player.destX == player.x && player.destY == player.y) {
+        if (newInput.key_left) {
+            player.accelX = -accel;
+            player.destX = player.x - 1;
+            player.destAngle = M_PI;
+        }
+        if (newInput.key_right) {
+            player.accelX = accel;
+            player.destX = player.x + 1;
+            player.destAngle = 0.0f;
+        }
+        if (newInput.key_up) {
+            player.accelY = -accel;
+            player.destY = player.y - 1;
+            player.destAngle = M_PI / 2.0f;
+        }
+        if (newInput.key_down) {
+            player.accelY = accel;
+            player.destY = player.y + 1;
+            player.destAngle = (3.0f * M_PI) / 2.0f;
+        }
+/* Test scaling */
+#if 1
+        if (newInput.key_z && player.scale > PLAYER_MIN_SCALE) {
+            player.scale -= 0.1f * dtFrame * BASE_TICK_RATE;
+        }
+        if (newInput.key_x && player.scale < PLAYER_MAX_SCALE) {
+            player.scale += 0.1f * dtFrame * BASE_TICK_RATE;
+        }
+#endif
+    }
+    /* If a rotation is incomplete, adjust the player's actual angle
+     * toward its destination. */
+    player.angle = turnStep(player.angle, player.destAngle, dtFrame);
+    /* Collision detection against the borders of the tile paths */
+    if (player.destX != player.x &&
+        borderCollide(player.destX, player.y)) {
+        player.destX = player.x;
+    }
+    if (player.destY != player.y &&
+        borderCollide(player.x, player.destY)) {
+        player.destY = player.y;
+    }
+    /* Move the player toward the destination set by the input */
+    if (player.destX != player.x) {
+        player.velocityX += player.accelX * dtFrame;
+        player.pixelX += player.velocityX * dtFrame;
+        /* Make the player appear to hop as it moves */
+        player.scale += hopGrowth(fabsf(player.velocityX), dtFrame);
+        /* When the tile move is complete, reset and adjust */
+        int dx = tileLanding(player.pixelX);
+        if (dx) {
+            player.pixelX = 0;
+            player.x += dx;
+            player.velocityX = 0;
+            player.scale = 1.0f;
+            initRipple(player.x, player.y);
+        }
+    } else if (player.destY != player.y) {
+        player.velocityY += player.accelY * dtFrame;
+        player.pixelY += player.velocityY * dtFrame;
+        player.scale += hopGrowth(fabsf(player.velocityY), dtFrame);
+        int dy = tileLanding(player.pixelY);
+        if (dy) {
+            player.pixelY = 0;
+            player.y += dy;
+            player.accelX = 0;
+            player.velocityY = 0;
+            player.scale = 1.0f;
+            initRipple(player.x, player.y);
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * processInput
+ *
+ * Miscellaneous input handling.
+ *--------------------------------------------------------------------*/
+void processInput()
+{
+    if (newInput.key_q) {
+        running = 0;
+    }
+    if (newInput.key_r && !oldInput.key_r) {
+        initRipple(10, 10);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * Entities
+ *--------------------------------------------------------------------*/
+
+/* A step in each of the four directions, and the angle of a sprite
+ * facing that way */
+const int stepX[4] = {1, 0, -1, 0};
+const int stepY[4] = {0, 1, 0, -1};
+const float stepAngles[4] = {
+    0.0f, (3.0f * M_PI) / 2.0f, M_PI, M_PI / 2.0f
+};
+
+/*--------------------------------------------------------------------
+ * entityRandom
+ *
+ * Xorshift, for the entities' own random numbers.
+ *--------------------------------------------------------------------*/
+unsigned int entityRandom()
+{
+    unsigned int x = entities.random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    entities.random = x;
+    return x;
+}
+
+/*--------------------------------------------------------------------
+ * spatialCell, spatialBucket
+ *
+ * The grid cell a tile is in, and the bucket a cell is hashed to.
+ * Cells are found with floor division, so that cells on both sides of
+ * the origin are the same size.
+ *--------------------------------------------------------------------*/
+int spatialCell(int tile)
+{
+    return (tile >= 0 ? tile : tile - SPATIAL_CELL_TILES + 1) / SPATIAL_CELL_TILES;
+}
+
+unsigned int spatialBucket(int cellX, int cellY)
+{
+    return ((unsigned int)cellX * 73856093u ^ (unsigned int)cellY * 19349663u)
+        & (SPATIAL_BUCKETS - 1);
+}
+
+/*--------------------------------------------------------------------
+ * buildSpatialGrid
+ *
+ * Sort every entity that isn't dormant into the grid by the tile it's
+ * on, with a counting sort: count the entities in each bucket, turn
+ * the counts into where each bucket ends, then place the entities from
+ * the last back, which leaves each bucket's in order and its start
+ * where the end was.
+ *--------------------------------------------------------------------*/
+void buildSpatialGrid()
+{
+    int count = entities.midEnd < entities.count
+        ? entities.midEnd : entities.count;
+    if (!spatialGrid.cellStart) {
+        spatialGrid.cellStart = memAlloc((SPATIAL_BUCKETS + 1) * sizeof(int),
+            MEM_ENTITIES);
+    }
+    if (count > spatialGrid.capacity) {
+        memFree(spatialGrid.indices);
+        memFree(spatialGrid.buckets);
+        spatialGrid.indices = memAlloc(count * sizeof(int), MEM_ENTITIES);
+        spatialGrid.buckets = memAlloc(count * sizeof(int), MEM_ENTITIES);
+        spatialGrid.capacity = count;
+    }
+    int *cellStart = spatialGrid.cellStart;
+    int *buckets = spatialGrid.buckets;
+    memset(cellStart, 0, (SPATIAL_BUCKETS + 1) * sizeof(int));
+    for (int i = 0; i < count; ++i) {
+        buckets[i] = spatialBucket(spatialCell(entities.x[i]),
+            spatialCell(entities.y[i]));
+        ++cellStart[buckets[i]];
+    }
+    int end = 0;
+    for (int b = 0; b < SPATIAL_BUCKETS; ++b) {
+        end += cellStart[b];
+        cellStart[b] = end;
+    }
+    cellStart[SPATIAL_BUCKETS] = count;
+    for (int i = count - 1; i >= 0; --i) {
+        spatialGrid.indices[--cellStart[buckets[i]]] = i;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * spatialQueryRect, spatialQueryRadius
+ *
+ * Find the entities on the tiles of a rectangle, corners included, or
+ * within a number of tiles of a tile, and write their indices to out,
+ * up to max of them. Return the number written. Only the cells the
+ * area covers are looked at, and an entity is only taken from the
+ * cell it's actually in, since other cells can share its bucket.
+ *--------------------------------------------------------------------*/
+int spatialQueryRect(int x1, int y1, int x2, int y2, int *out, int max)
+{
+    int found = 0;
+    if (!spatialGrid.cellStart) {
+        return 0;
+    }
+    for (int cellY = spatialCell(y1); cellY <= spatialCell(y2); ++cellY) {
+        for (int cellX = spatialCell(x1); cellX <= spatialCell(x2); ++cellX) {
+            unsigned int b = spatialBucket(cellX, cellY);
+            for (int j = spatialGrid.cellStart[b];
+                j < spatialGrid.cellStart[b + 1]; ++j) {
+                int i = spatialGrid.indices[j];
+                int x = entities.x[i];
+                int y = entities.y[i];
+                if (spatialCell(x) != cellX || spatialCell(y) != cellY
+                    || x < x1 || x > x2 || y < y1 || y > y2) {
+                    continue;
+                }
+                if (found == max) {
+                    return found;
+                }
+                out[found++] = i;
+            }
+        }
+    }
+    return found;
+}
+
+int spatialQueryRadius(int tileX, int tileY, int radius, int *out, int max)
+{
+    int found = spatialQueryRect(tileX - radius, tileY - radius,
+        tileX + radius, tileY + radius, out, max);
+    int kept = 0;
+    for (int j = 0; j < found; ++j) {
+        int dx = entities.x[out[j]] - tileX;
+        int dy = entities.y[out[j]] - tileY;
+        if (dx * dx + dy * dy <= radius * radius) {
+            out[kept++] = out[j];
+        }
+    }
+    return kept;
+}
+
+/*--------------------------------------------------------------------
+ * fleeRipples
+ *
+ * Turn every entity a spreading ripple has reached away from it, on
+ * whichever axis it's farther along. It sets off that way once it's
+ * done the tile move it's on, if the way is open.
+ *--------------------------------------------------------------------*/
+void fleeRipples()
+{
+    int found[SPATIAL_QUERY_MAX];
+    for (int r = 0; r < 5; ++r) {
+        const Ripple *ripple = &rippleArray[r];
+        if (!ripple->active) {
+            continue;
+        }
+        int reach = ripple->radius / TILESIZE + 1;
+        int count = spatialQueryRadius(ripple->tileX, ripple->tileY, reach,
+            found, SPATIAL_QUERY_MAX);
+        for (int j = 0; j < count; ++j) {
+            int i = found[j];
+            int dx = entities.x[i] - ripple->tileX;
+            int dy = entities.y[i] - ripple->tileY;
+            if (abs(dx) >= abs(dy)) {
+                entities.direction[i] = dx >= 0 ? 0 : 2;
+            } else {
+                entities.direction[i] = dy >= 0 ? 1 : 3;
+            }
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * steerEntities
+ *
+ * Start every entity in a range that's at rest on a tile toward the
+ * next one: ahead usually, or now and then a turn, and around to
+ * whichever way is open if the path is blocked.
+ *--------------------------------------------------------------------*/
+void steerEntities(int first, int last)
+{
+    float accel = HOP_ACCEL;
+    for (int i = first; i < last; ++i) {
+        if (entities.destX[i] != entities.x[i]
+            || entities.destY[i] != entities.y[i]) {
+            continue;
+        }
+        int direction = entities.direction[i];
+        unsigned int turn = entityRandom();
+        if (turn % 8 == 0) {
+            direction = (direction + (turn & 8 ? 1 : 3)) % 4;
+        }
+        int tries;
+        for (tries = 0; tries < 4; ++tries) {
+            if (!borderCollide(entities.x[i] + stepX[direction],
+                entities.y[i] + stepY[direction])) {
+                break;
+            }
+            direction = (direction + 1) % 4;
+        }
+        if (tries == 4) {
+            continue;
+        }
+        entities.direction[i] = direction;
+        entities.destX[i] = entities.x[i] + stepX[direction];
+        entities.destY[i] = entities.y[i] + stepY[direction];
+        entities.accelX[i] = stepX[direction] * accel;
+        entities.accelY[i] = stepY[direction] * accel;
+        entities.destAngle[i] = stepAngles[direction];
+    }
+}
+
+/*--------------------------------------------------------------------
+ * turnEntities
+ *
+ * Turn every entity in a range toward the way it's going, as the
+ * player turns, by dt's worth of turning.
+ *--------------------------------------------------------------------*/
+void turnEntities(int first, int last, float dt)
+{
+    for (int i = first; i < last; ++i) {
+        entities.angle[i] = turnStep(entities.angle[i], entities.destAngle[i],
+            dt);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * moveEntities
+ *
+ * Integrate the motion of a number of entities, a whole number of
+ * blocks of them, with the same hop as the player's. An entity at
+ * rest has no acceleration or velocity, so the loop can run over all
+ * of them with no branches, and the padding at the end of the arrays
+ * is entities that never move. Going a block at a time lets the
+ * compiler vectorize it without a scalar tail. The arrays are passed
+ * in, since the compiler only trusts restrict on parameters.
+ *--------------------------------------------------------------------*/
+void moveEntities(int count, float dt,
+    float *restrict pixelX, float *restrict pixelY,
+    float *restrict velocityX, float *restrict velocityY,
+    const float *restrict accelX, const float *restrict accelY,
+    float *restrict scale)
+{
+    for (int block = 0; block < count; block += ENTITY_BLOCK) {
+        for (int i = block; i < block + ENTITY_BLOCK; ++i) {
+            velocityX[i] += accelX[i] * dt;
+            velocityY[i] += accelY[i] * dt;
+            pixelX[i] += velocityX[i] * dt;
+            pixelY[i] += velocityY[i] * dt;
+            scale[i] += hopGrowth(fabsf(velocityX[i]) + fabsf(velocityY[i]),
+                dt);
+        }
+    }
+}
+
+/*--------------------------------------------------------------------
+ * landEntities
+ *
+ * Finish the tile move of every entity in a range that has gone a
+ * whole tile. A long step can carry an entity past the end of its
+ * tile, but it still lands on it.
+ *--------------------------------------------------------------------*/
+void landEntities(int first, int last)
+{
+    for (int i = first; i < last; ++i) {
+        int dx = tileLanding(entities.pixelX[i]);
+        int dy = tileLanding(entities.pixelY[i]);
+        if (!dx && !dy) {
+            continue;
+        }
+        entities.x[i] += dx;
+        entities.y[i] += dy;
+        entities.pixelX[i] = 0;
+        entities.pixelY[i] = 0;
+        entities.velocityX[i] = 0;
+        entities.velocityY[i] = 0;
+        entities.accelX[i] = 0;
+        entities.accelY[i] = 0;
+        entities.scale[i] = 1.0f;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * updateEntityRange
+ *
+ * Advance a range of entities, starting and ending on block
+ * boundaries, by dt.
+ *--------------------------------------------------------------------*/
+void updateEntityRange(int first, int last, float dt)
+{
+    int lastReal = last < entities.count ? last : entities.count;
+    if (first >= last) {
+        return;
+    }
+    steerEntities(first, lastReal);
+    turnEntities(first, lastReal, dt);
+    moveEntities(last - first, dt,
+        entities.pixelX + first, entities.pixelY + first,
+        entities.velocityX + first, entities.velocityY + first,
+        entities.accelX + first, entities.accelY + first,
+        entities.scale + first);
+    landEntities(first, lastReal);
+}
+
+/*--------------------------------------------------------------------
+ * assignEntityTiers
+ *
+ * Put each entity in a tier by its distance in tiles from the camera,
+ * and rearrange all of their arrays, tier by tier, keeping their order
+ * within a tier.
+ *--------------------------------------------------------------------*/
+void assignEntityTiers()
+{
+    int count = entities.count;
+    int nearX = DISPLAY_TW / 2 + LOD_NEAR_MARGIN;
+    int nearY = DISPLAY_TH / 2 + LOD_NEAR_MARGIN;
+    int starts[LOD_TIER_COUNT] = {0};
+    memset(entities.tierCounts, 0, sizeof(entities.tierCounts));
+    for (int i = 0; i < count; ++i) {
+        int dx = abs(entities.x[i] - cam.tileX);
+        int dy = abs(entities.y[i] - cam.tileY);
+        int tier = LOD_DORMANT;
+        if (dx <= nearX && dy <= nearY) {
+            tier = LOD_NEAR;
+        } else if (dx <= LOD_MID_TILES && dy <= LOD_MID_TILES) {
+            tier = LOD_MID;
+        }
+        entities.tier[i] = tier;
+        ++entities.tierCounts[tier];
+    }
+    for (int t = 1; t < LOD_TIER_COUNT; ++t) {
+        starts[t] = starts[t - 1] + entities.tierCounts[t - 1];
+    }
+    for (int i = 0; i < count; ++i) {
+        entities.order[starts[entities.tier[i]]++] = i;
+    }
+    void *arrays[] = {
+        entities.x, entities.y, entities.destX, entities.destY,
+        entities.direction, entities.pixelX, entities.pixelY,
+        entities.velocityX, entities.velocityY,
+        entities.accelX, entities.accelY,
+        entities.angle, entities.destAngle, entities.scale
+    };
+    for (size_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); ++a) {
+        unsigned int *array = arrays[a];
+        for (int i = 0; i < count; ++i) {
+            entities.scratch[i] = array[entities.order[i]];
+        }
+        memcpy(array, entities.scratch, count * sizeof(unsigned int));
+    }
+    int padded = (count + ENTITY_BLOCK - 1) / ENTITY_BLOCK * ENTITY_BLOCK;
+    int nearEnd = (entities.tierCounts[LOD_NEAR] + ENTITY_BLOCK - 1)
+        / ENTITY_BLOCK * ENTITY_BLOCK;
+    int midEnd = (entities.tierCounts[LOD_NEAR] + entities.tierCounts[LOD_MID]
+        + ENTITY_BLOCK - 1) / ENTITY_BLOCK * ENTITY_BLOCK;
+    entities.nearEnd = nearEnd < padded ? nearEnd : padded;
+    entities.midEnd = midEnd < padded ? midEnd : padded;
+}
+
+/*--------------------------------------------------------------------
+ * initEntities
+ *
+ * Make room for a number of entities and scatter them, at rest, over
+ * the tiles of the map. The sprite they're drawn with is left alone.
+ *--------------------------------------------------------------------*/
+void initEntities(int count)
+{
+    memFree(entities.block);
+    entities.block = NULL;
+    entities.count = count;
+    entities.nearEnd = entities.midEnd = 0;
+    if (!count) {
+        return;
+    }
+    /* Each array is aligned, and padded to a whole block */
+    size_t padded = (count + ENTITY_BLOCK - 1) / ENTITY_BLOCK * ENTITY_BLOCK;
+    size_t ints = padded * sizeof(int);
+    size_t floats = padded * sizeof(float);
+    unsigned char *p = entities.block = memAllocAligned(
+        8 * ints + 9 * floats, BITMAP_ALIGN, MEM_ENTITIES);
+    int **intArrays[] = {
+        &entities.x, &entities.y, &entities.destX, &entities.destY,
+        &entities.direction, &entities.tier, &entities.order,
+        (int **)&entities.scratch
+    };
+    float **floatArrays[] = {
+        &entities.pixelX, &entities.pixelY,
+        &entities.velocityX, &entities.velocityY,
+        &entities.accelX, &entities.accelY,
+        &entities.angle, &entities.destAngle, &entities.scale
+    };
+    for (int i = 0; i < 8; ++i, p += ints) {
+        *intArrays[i] = (int *)p;
+    }
+    for (int i = 0; i < 9; ++i, p += floats) {
+        *floatArrays[i] = (float *)p;
+    }
+    entities.random = rand() | 1;
+    for (int i = 0; i < count; ++i) {
+        const Tile *tile = &tileArray[entityRandom() % mapLength];
+        int direction = entityRandom() % 4;
+        entities.x[i] = entities.destX[i] = tile->x;
+        entities.y[i] = entities.destY[i] = tile->y;
+        entities.direction[i] = direction;
+        entities.angle[i] = entities.destAngle[i] = stepAngles[direction];
+        entities.scale[i] = 1.0f;
+    }
+    assignEntityTiers();
+    buildSpatialGrid();
+}
+
+/*--------------------------------------------------------------------
+ * updateEntities
+ *
+ * Advance the near entities by one step, and one slice of the middle
+ * ones by LOD_MID_INTERVAL steps, reassigning tiers when it's time,
+ * then sort them into the grid where they ended up.
+ *--------------------------------------------------------------------*/
+void updateEntities()
+{
+    if (!entities.count) {
+        return;
+    }
+    /* The grid from the last step still matches the entities' order,
+     * and the directions set here move with them if they're sorted */
+    fleeRipples();
+    if (stepCount % LOD_ASSIGN_STEPS == 0) {
+        assignEntityTiers();
+    }
+    updateEntityRange(0, entities.nearEnd, dtFrame);
+    int blocks = (entities.midEnd - entities.nearEnd) / ENTITY_BLOCK;
+    int sliceBlocks = (blocks + LOD_MID_INTERVAL - 1) / LOD_MID_INTERVAL;
+    int first = entities.nearEnd
+        + stepCount % LOD_MID_INTERVAL * sliceBlocks * ENTITY_BLOCK;
+    int last = first + sliceBlocks * ENTITY_BLOCK;
+    if (last > entities.midEnd) {
+        last = entities.midEnd;
+    }
+    updateEntityRange(first, last, dtFrame * LOD_MID_INTERVAL);
+    buildSpatialGrid();
+}
+
+/*--------------------------------------------------------------------
+ * submitSprite
+ *
+ * Queue a sprite to be drawn this frame, on a layer, with its box's
+ * top left corner at the given point, rotated and scaled. Sprites
+ * entirely off the display are dropped here, before anything is
+ * transformed.
+ *--------------------------------------------------------------------*/
+void submitSprite(int layer, const Asset *sprite, int x, int y,
+    float angle, float scale)
+{
+    int dx, dy, width, height;
+    transformOffset(sprite->bitmap, scale, &dx, &dy, &width, &height);
+    if (x + dx + width <= 0 || x + dx >= display.width
+        || y + dy + height <= 0 || y + dy >= display.height) {
+        return;
+    }
+    if (spriteBatch.count == spriteBatch.capacity) {
+        int capacity = spriteBatch.capacity ? spriteBatch.capacity * 2 : 256;
+        SpriteDraw *draws = memAlloc(capacity * sizeof(SpriteDraw), MEM_SPRITES);
+        if (spriteBatch.draws) {
+            memcpy(draws, spriteBatch.draws, spriteBatch.count * sizeof(SpriteDraw));
+            memFree(spriteBatch.draws);
+        }
+        spriteBatch.draws = draws;
+        spriteBatch.capacity = capacity;
+    }
+    SpriteDraw *draw = &spriteBatch.draws[spriteBatch.count];
+    draw->sprite = sprite;
+    draw->layer = layer;
+    draw->order = spriteBatch.count++;
+    draw->x = x;
+    draw->y = y;
+    draw->angle = angle;
+    draw->scale = scale;
+    draw->page = atlasPage(sprite->bitmap);
+}
+
+int spriteDrawCompare(const void *a, const void *b)
+{
+    const SpriteDraw *drawA = a;
+    const SpriteDraw *drawB = b;
+    if (drawA->layer != drawB->layer) {
+        return drawA->layer - drawB->layer;
+    }
+    if (drawA->y != drawB->y) {
+        return drawA->y - drawB->y;
+    }
+    if (drawA->page != drawB->page) {
+        return drawA->page - drawB->page;
+    }
+    return drawA->order - drawB->order;
+}
+
+/*--------------------------------------------------------------------
+ * spriteImage
+ *
+ * Work out what a queued sprite looks like and where its top left
+ * corner goes. Facing straight along a tile path at normal size, the
+ * pose frame from the archive is the same as what transformBitmap
+ * would render, so it's used as it is. Otherwise, a sprite that's
+ * been transformed the same way already this batch shares that one.
+ *--------------------------------------------------------------------*/
+void spriteImage(SpriteDraw *draw, SpriteTransform *cache, unsigned int mask)
+{
+    const Asset *sprite = draw->sprite;
+    if (sprite->poses[0].data && fabsf(draw->scale - 1.0f) < 1e-4f) {
+        for (int i = 0; i < POSE_COUNT; ++i) {
+            if (fabsf(draw->angle - poseAngles[i]) < 1e-4f) {
+                draw->image = sprite->poses[i];
+                draw->x1 = draw->x;
+                draw->y1 = draw->y;
+                return;
+            }
+        }
+    }
+    unsigned int angleBits, scaleBits;
+    memcpy(&angleBits, &draw->angle, sizeof(angleBits));
+    memcpy(&scaleBits, &draw->scale, sizeof(scaleBits));
+    unsigned int hash = (unsigned int)(size_t)sprite->bitmap.data * 2654435761u;
+    hash = (hash ^ angleBits) * 2654435761u;
+    hash = (hash ^ scaleBits) * 2654435761u;
+    SpriteTransform *entry = &cache[hash & mask];
+    while (entry->image.data) {
+        if (entry->source == sprite->bitmap.data
+            && entry->angleBits == angleBits
+            && entry->scaleBits == scaleBits) {
+            break;
+        }
+        entry = &cache[(entry - cache + 1) & mask];
+    }
+    if (!entry->image.data) {
+        int width, height;
+        entry->source = sprite->bitmap.data;
+        entry->angleBits = angleBits;
+        entry->scaleBits = scaleBits;
+        transformOffset(sprite->bitmap, draw->scale, &entry->dx, &entry->dy,
+            &width, &height);
+        entry->image = transformBitmap(sprite->bitmap, sprite->mips,
+            draw->angle, draw->scale);
+    }
+    draw->image = entry->image;
+    draw->x1 = draw->x + entry->dx;
+    draw->y1 = draw->y + entry->dy;
+}
+
+/*--------------------------------------------------------------------
+ * flushSprites
+ *
+ * Draw everything queued this frame: sort it by layer, then top to
+ * bottom, then atlas page, transform each distinct sprite once, then
+ * rasterize band by band down the display, so that each band of the
+ * display stays in cache while every sprite over it is drawn.
+ *--------------------------------------------------------------------*/
+void flushSprites()
+{
+    int count = spriteBatch.count;
+    if (!count) {
+        return;
+    }
+    SpriteDraw *draws = spriteBatch.draws;
+    qsort(draws, count, sizeof(SpriteDraw), spriteDrawCompare);
+    unsigned int size = 16;
+    while (size < 2u * count) {
+        size *= 2;
+    }
+    SpriteTransform *cache = arenaAlloc(&frameArena,
+        size * sizeof(SpriteTransform));
+    for (int i = 0; i < count; ++i) {
+        spriteImage(&draws[i], cache, size - 1);
+    }
+    for (int top = 0; top < display.height; top += SPRITE_BAND_HEIGHT) {
+        int bottom = top + SPRITE_BAND_HEIGHT < display.height
+            ? top + SPRITE_BAND_HEIGHT : display.height;
+        for (int i = 0; i < count; ++i) {
+            const SpriteDraw *draw = &draws[i];
+            if (draw->y1 < bottom && draw->y1 + draw->image.height > top) {
+                blitBand(draw->image, draw->x1, draw->y1, top, bottom);
+            }
+        }
+    }
+    spriteBatch.count = 0;
+}
+
+/*--------------------------------------------------------------------
+ * drawEntities
+ *
+ * Queue every entity near enough to the camera to be seen, which can
+ * only be one in the near tier. Entities aren't interpolated: each is
+ * drawn where the last step left it.
+ *--------------------------------------------------------------------*/
+void drawEntities()
+{
+    const Asset *sprite = resourceAsset(entities.sprite);
+    if (!sprite->bitmap.data) {
+        return;
+    }
+    int count = entities.nearEnd < entities.count
+        ? entities.nearEnd : entities.count;
+    int centerX = DISPLAY_TW / 2;
+    int centerY = DISPLAY_TH / 2;
+    int offsetX = -view.camPixelX;
+    int offsetY = -view.camPixelY;
+    for (int i = 0; i < count; ++i) {
+        int tileX = entities.x[i] - view.camTileX;
+        int tileY = entities.y[i] - view.camTileY;
+        if (tileX < -centerX - 2 || tileX > centerX + 2
+            || tileY < -centerY - 2 || tileY > centerY + 2) {
+            continue;
+        }
+        int x = (tileX + centerX) * TILESIZE + entities.pixelX[i];
+        int y = (tileY + centerY) * TILESIZE + entities.pixelY[i];
+        submitSprite(SPRITE_LAYER_ENTITIES, sprite, x + offsetX, y + offsetY,
+            entities.angle[i], entities.scale[i] * entities.spriteScale);
+    }
+}
+
+/*--------------------------------------------------------------------
+ * drawPlayer
+ *
+ * Adjust the player's coordinates so that it is drawn relative to the
+ * camera, both as interpolated for this frame, and queue it.
+ *--------------------------------------------------------------------*/
+void drawPlayer()
+{
+    int centerX = DISPLAY_TW / 2;
+    int centerY = DISPLAY_TH / 2;
+    int x = (view.playerTileX - view.camTileX + centerX) * TILESIZE;
+    int y = (view.playerTileY - view.camTileY + centerY) * TILESIZE;
+    int offsetX = view.playerPixelX - view.camPixelX;
+    int offsetY = view.playerPixelY - view.camPixelY;
+    submitSprite(SPRITE_LAYER_PLAYER, resourceAsset(player.sprite),
+        x + offsetX, y + offsetY, view.playerAngle, view.playerScale);
+}
+
+/*--------------------------------------------------------------------
+ * initGame
+ *
+ * Put the camera and the player at the origin, clear any ripples,
+ * restart the step clock, generate a new map from the current random
+ * seed, and scatter the fish over it. The sprites are left alone.
+ *--------------------------------------------------------------------*/
+void initGame()
+{
+    cam.tileX = 0;
+    cam.tileY = 0;
+    cam.destTileX = 0;
+    cam.destTileY = 0;
+    cam.pixelX = 0;
+    cam.pixelY = 0;
+    cam.accelX = 0;
+    cam.accelY = 0;
+    cam.velocityX = 0;
+    cam.velocityY = 0;
+    player.x = 0;
+    player.y = 0;
+    player.destX = 0;
+    player.destY = 0;
+    player.pixelX = 0;
+    player.pixelY = 0;
+    player.velocityX = 0;
+    player.velocityY = 0;
+    player.accelX = 0;
+    player.accelY = 0;
+    player.angle = 0.0f;
+    player.destAngle = 0.0f;
+    player.oldDirection = 1;
+    player.newDirection = 1;
+    player.scale = 1.0f;
+    player.destScale = 1.0f;
+    initRipples();
+    memset(&newInput, 0, sizeof(newInput));
+    memset(&oldInput, 0, sizeof(oldInput));
+    memset(&heldInput, 0, sizeof(heldInput));
+    prevCam = cam;
+    prevPlayer = player;
+    stepCount = 0;
+    scheduler.lastTime = 0;
+    scheduler.accumulator = 0;
+    initMap();
+    initEntities(scenario ? scenario->fish : options.fish);
+}
+
+/*--------------------------------------------------------------------
+ * simulate
+ *
+ * Advance the game by one fixed step of dtFrame, keeping the state it
+ * started from for interpolation.
+ *--------------------------------------------------------------------*/
+void simulate()
+{
+    prevCam = cam;
+    prevPlayer = player;
+    stepInput();
+    if (!running) {
+        return;
+    }
+#ifdef KUJIRA_PROFILE
+    profileInputEdge();
+#endif
+    processInput();
+    PROFILE_CALL(STAGE_UPDATE_PLAYER, updatePlayer());
+    PROFILE_CALL(STAGE_UPDATE_CAMERA, updateCamera());
+    PROFILE_CALL(STAGE_UPDATE_ENTITIES, updateEntities());
+    updateRipples();
+    oldInput = newInput;
+    ++stepCount;
+}
+
+/*--------------------------------------------------------------------
+ * scheduleSteps
+ *
+ * Work out how many simulation steps this frame owes, and how far
+ * between the last two states to draw it. If the game has fallen so
+ * far behind that catching up would take more than MAX_FRAME_SIM_TIME
+ * of steps, the rest of the backlog is dropped, and the game slows
+ * down rather than stalling.
+ *--------------------------------------------------------------------*/
+int scheduleSteps()
+{
+    if (scheduler.lockstep) {
+        scheduler.alpha = 1.0f;
+        return 1;
+    }
+    unsigned long long now = monotonicNs();
+    if (scheduler.lastTime == 0) {
+        scheduler.lastTime = now - (unsigned long long)(dtFrame * 1e9);
+    }
+    scheduler.accumulator += (now - scheduler.lastTime) / 1e9f;
+    scheduler.lastTime = now;
+    int steps = (int)(scheduler.accumulator / dtFrame);
+    int maxSteps = fastCeil(MAX_FRAME_SIM_TIME / dtFrame);
+    if (steps > maxSteps) {
+        scheduler.droppedSteps += steps - maxSteps;
+        steps = maxSteps;
+        scheduler.accumulator -= fastFloor(scheduler.accumulator / dtFrame)
+            * dtFrame;
+    } else {
+        scheduler.accumulator -= steps * dtFrame;
+    }
+    scheduler.alpha = scheduler.accumulator / dtFrame;
+    return steps;
+}
+
+/*--------------------------------------------------------------------
+ * lerp
+ *
+ * Linear interpolation that lands exactly on b when t is 1.
+ *--------------------------------------------------------------------*/
+float lerp(float a, float b, float t)
+{
+    return a * (1.0f - t) + b * t;
+}
+
+/*--------------------------------------------------------------------
+ * interpolateView
+ *
+ * Place the camera and the player part way, by alpha, from their
+ * previous simulation state to their current one. The player moves
+ * between tiles continuously, so its previous offset is re-expressed
+ * relative to its current tile. When the camera's tile changes, a
+ * scroll has just finished or begun and the background buffers have
+ * moved on with it, so the camera snaps to its current state.
+ *--------------------------------------------------------------------*/
+void interpolateView(float alpha)
+{
+    view.camTileX = cam.tileX;
+    view.camTileY = cam.tileY;
+    if (prevCam.tileX == cam.tileX && prevCam.tileY == cam.tileY) {
+        view.camPixelX = lerp(prevCam.pixelX, cam.pixelX, alpha);
+        view.camPixelY = lerp(prevCam.pixelY, cam.pixelY, alpha);
+    } else {
+        view.camPixelX = cam.pixelX;
+        view.camPixelY = cam.pixelY;
+    }
+    float prevPixelX = prevPlayer.pixelX + (prevPlayer.x - player.x) * TILESIZE;
+    float prevPixelY = prevPlayer.pixelY + (prevPlayer.y - player.y) * TILESIZE;
+    view.playerTileX = player.x;
+    view.playerTileY = player.y;
+    view.playerPixelX = lerp(prevPixelX, player.pixelX, alpha);
+    view.playerPixelY = lerp(prevPixelY, player.pixelY, alpha);
+    view.playerScale = lerp(prevPlayer.scale, player.scale, alpha);
+    /* Don't interpolate the long way round when the angle wraps */
+    if (fabsf(player.angle - prevPlayer.angle) < 1.0f) {
+        view.playerAngle = lerp(prevPlayer.angle, player.angle, alpha);
+    } else {
+        view.playerAngle = player.angle;
+    }
+}
+
+/*--------------------------------------------------------------------
+ * atRest
+ *
+ * Whether the last simulation step left the world as it found it,
+ * with no ripple still spreading and no key held that could change
+ * it on the next one.
+ *--------------------------------------------------------------------*/
+int atRest()
+{
+    static const Input noInput;
+    /* Fish never stop swimming */
+    if (memcmp(&heldInput, &noInput, sizeof(Input)) != 0
+        || atomic_load(&inputQueue.head) != atomic_load(&inputQueue.tail)
+        || entities.count) {
+        return 0;
+    }
+    for (int i = 0; i < 5; ++i) {
+        if (rippleArray[i].active) {
+            return 0;
+        }
+    }
+    return cam.tileX == prevCam.tileX && cam.tileY == prevCam.tileY
+        && cam.destTileX == cam.tileX && cam.destTileY == cam.tileY
+        && cam.pixelX == prevCam.pixelX && cam.pixelY == prevCam.pixelY
+        && player.x == prevPlayer.x && player.y == prevPlayer.y
+        && player.destX == player.x && player.destY == player.y
+        && player.pixelX == prevPlayer.pixelX
+        && player.pixelY == prevPlayer.pixelY
+        && player.angle == prevPlayer.angle
+        && player.angle == player.destAngle
+        && player.scale == prevPlayer.scale;
+}
+
+/*--------------------------------------------------------------------
+ * idleWait
+ *
+ * Block on the backend until there's an event or the idle timeout
+ * passes, then start the frame clocks over, so that the time spent
+ * waiting isn't simulated or counted as a missed frame.
+ *--------------------------------------------------------------------*/
+void idleWait()
+{
+    display.backend->wait(IDLE_TIMEOUT_MS);
+    ++idle.waits;
+    scheduler.lastTime = 0;
+    scheduler.accumulator = 0;
+    pacer.lastFrame = 0;
+    pacer.deadline = monotonicNs();
+}
+
+/*--------------------------------------------------------------------
+ * runFrame
+ *
+ * One pass through the game loop: any assets that were reloaded are
+ * swapped in, then input, as many simulation steps as are due, and
+ * rendering. Does nothing more if the input source ends the run. With
+ * --sim-only, the rendering is skipped altogether, and it's skipped
+ * while idle once the resting world has been drawn.
+ *--------------------------------------------------------------------*/
+void runFrame()
+{
+    arenaReset(&frameArena);
+    if (swapResources()) {
+        idle.resting = 0;
+    }
+    PROFILE_BEGIN(STAGE_FRAME);
+    PROFILE_CALL(STAGE_GET_INPUT, getInput());
+    int steps = scheduleSteps();
+    for (int i = 0; i < steps && running; ++i) {
+        simulate();
+    }
+    if (!running) {
+        PROFILE_END(STAGE_FRAME);
+#ifdef KUJIRA_PROFILE
+        profileEndFrame();
+#endif
+        return;
+    }
+    if (idle.enabled) {
+#ifdef KUJIRA_PROFILE
+        /* The overlay's numbers change every frame */
+        int rest = !profiler.overlay && atRest();
+#else
+        int rest = atRest();
+#endif
+        if (rest && idle.resting) {
+            PROFILE_END(STAGE_FRAME);
+#ifdef KUJIRA_PROFILE
+            profileEndFrame();
+#endif
+            ++idle.skipped;
+            ++frameCount;
+            return;
+        }
+        idle.resting = rest;
+    }
+    if (options.simOnly) {
+        PROFILE_END(STAGE_FRAME);
+#ifdef KUJIRA_PROFILE
+        profileEndFrame();
+#endif
+        ++frameCount;
+        return;
+    }
+    interpolateView(scheduler.alpha);
+    PROFILE_CALL(STAGE_DRAW_BACKGROUND, drawBackground());
+    PROFILE_CALL(STAGE_ANIMATE_RIPPLE, animateRipple());
+    PROFILE_CALL(STAGE_DRAW_ENTITIES, drawEntities());
+    PROFILE_CALL(STAGE_DRAW_PLAYER, drawPlayer());
+    PROFILE_CALL(STAGE_DRAW_SPRITES, flushSprites());
+#ifdef KUJIRA_PROFILE
+    if (profiler.overlay) {
+        drawProfileOverlay();
+    }
+#endif
+    PROFILE_CALL(STAGE_BLIT_DISPLAY, blitDisplay());
+    PROFILE_END(STAGE_FRAME);
+#ifdef KUJIRA_PROFILE
+    profilePresented();
+    profileEndFrame();
+#endif
+    ++frameCount;
+}
+
+/*--------------------------------------------------------------------
+ * Benchmark scenarios
+ *
+ * Whole frames through runFrame, headless and uncapped, in the
+ * situations that cost the most.
+ *--------------------------------------------------------------------*/
+int scenarioDirection;
+
+/* Nothing moves */
+void driveIdle(long frame, Input *input)
+{
+    (void)frame;
+    (void)input;
+}
+
+/* Keep swimming along the path, turning whenever the way ahead is
+ * blocked and every so often anyway, and splash every few frames. */
+void driveSwim(long frame, Input *input)
+{
+    if (frame % 90 == 0) {
+        scenarioDirection = (scenarioDirection + 1) % 4;
+    }
+    for (int tries = 0; tries < 4; ++tries) {
+        int x = player.x + stepX[scenarioDirection];
+        int y = player.y + stepY[scenarioDirection];
+        if (!borderCollide(x, y)) {
+            break;
+        }
+        scenarioDirection = (scenarioDirection + 1) % 4;
+    }
+    input->key_right = scenarioDirection == 0;
+    input->key_down = scenarioDirection == 1;
+    input->key_left = scenarioDirection == 2;
+    input->key_up = scenarioDirection == 3;
+    if (frame % 4 == 0) {
+        initRipple(player.x, player.y);
+    }
+}
+
+/* Start a new scroll as soon as the last one ends, by putting the
+ * player at the edge of the screen, going round in a square. */
+void driveScroll(long frame, Input *input)
+{
+    (void)frame;
+    (void)input;
+    if (cam.destTileX != cam.tileX || cam.destTileY != cam.tileY) {
+        return;
+    }
+    int horizEdge = (DISPLAY_TW / 2) - 2;
+    int vertEdge = (DISPLAY_TH / 2) - 2;
+    player.x = cam.tileX + stepX[scenarioDirection] * (horizEdge + 1);
+    player.y = cam.tileY + stepY[scenarioDirection] * (vertEdge + 1);
+    player.destX = player.x;
+    player.destY = player.y;
+    scenarioDirection = (scenarioDirection + 1) % 4;
+}
+
+/* Grow to the largest scale and keep turning, so every frame pays for
+ * the biggest scale and rotate, and the flip facing left */
+void driveWhale(long frame, Input *input)
+{
+    input->key_x = 1;
+    if (frame % 30 == 0) {
+        player.destAngle = ((frame / 30) % 4) * (M_PI / 2.0f);
+    }
+}
+
+const Scenario scenarios[] = {
+    {"idle", MAPLENGTH, 0, driveIdle},
+    {"scroll", MAPLENGTH, 0, driveScroll},
+    {"swim", MAPLENGTH, 0, driveSwim},
+    {"whale", MAPLENGTH, 0, driveWhale},
+    {"largemap", MAPLENGTH * 10, 0, driveScroll},
+    {"school", MAPLENGTH, 5000, driveSwim},
+};
+#define SCENARIO_COUNT (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* What a scenario run measured, with frame times in milliseconds */
+typedef struct scenarioResult {
+    const char *name;
+    long frames;
+    double mean;
+    double p99;
+    double p999;
+    double max;
+    unsigned long allocs;
+    double allocsPerFrame;
+} ScenarioResult;
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*--------------------------------------------------------------------
+ * runScenario
+ *
+ * Reset the world, warm up for a moment, then time the given number
+ * of frames. The result has no frames if there was no memory to time
+ * them in.
+ *--------------------------------------------------------------------*/
+ScenarioResult runScenario(const Scenario *s, long frames, unsigned int seed)
+{
+    ScenarioResult result;
+    memset(&result, 0, sizeof(result));
+    result.name = s->name;
+    double *times = memAlloc(frames * sizeof(double), MEM_OTHER);
+    if (!times) {
+        fprintf(stderr, "%s: no memory for %ld frame times\n", s->name,
+            frames);
+        return result;
+    }
+    scenario = s;
+    scenarioDirection = 0;
+    mapLength = s->mapLength;
+    srand(seed);
+    initGame();
+    drawMap();
+    frameCount = 0;
+    for (int i = 0; i < 30; ++i) {
+        runFrame();
+    }
+    unsigned long allocs = memStats.allocs;
+    double sum = 0;
+    for (long i = 0; i < frames; ++i) {
+        unsigned long long start = monotonicNs();
+        runFrame();
+        times[i] = (monotonicNs() - start) / 1e6;
+        sum += times[i];
+    }
+    qsort(times, frames, sizeof(double), compareDoubles);
+    result.frames = frames;
+    result.mean = sum / frames;
+    result.p99 = times[(long)ceil(frames * 0.99) - 1];
+    result.p999 = times[(long)ceil(frames * 0.999) - 1];
+    result.max = times[frames - 1];
+    result.allocs = memStats.allocs - allocs;
+    result.allocsPerFrame = result.allocs / (double)frames;
+    memFree(times);
+    scenario = NULL;
+    return result;
+}
+
+/*--------------------------------------------------------------------
+ * writeScenarioJson
+ *
+ * One scenario per line, so that readBaseline can pick them apart
+ * without a JSON parser.
+ *--------------------------------------------------------------------*/
+void writeScenarioJson(FILE *fp, const ScenarioResult *results, int count)
 {
-    int minX = (int)cam.pixelX;
-    int maxX = minX + DISPLAY_PW;
-    int minY = (int)cam.pixelY;
-    int maxY = minY + DISPLAY_PH;
-    /* If we're in the middle of a scroll */
-    if (cam.tileX != cam.destTileX || cam.tileY != cam.destTileY) {
-        for (int y = minY; y < maxY; ++y) {
-            for (int x = minX; x < maxX; ++x) {
-                unsigned int *src;
-                int newX = x;
-                int newY = y;
-                /* If x or y are negative, or if they're greater than
-                 * the pixel width of the screen, then they should
-                 * actually refer to a position on the new buffer.
-                 * Otherwise, this portion of the screen should still
-                 * be showing the old buffer. */
-                if (x < 0) {
-                    src = bgBufferNew.data;
-                    newX = x + SCROLL_PW;
-                } else if (x >= DISPLAY_PW) {
-                    src = bgBufferNew.data;
-                    newX = x - SCROLL_PW;
-                } else if (y < 0) {
-                    src = bgBufferNew.data;
-                    newY = y + SCROLL_PH;
-                } else if (y >= DISPLAY_PH) {
-                    src = bgBufferNew.data;
-                    newY = y - SCROLL_PH;
-                } else {
-                    src = bgBufferOld.data;
-                }
-                src += (newY * DISPLAY_PW) + newX;
-                unsigned int *dest = (unsigned int *)display.buffer;
-                dest += ((y - minY) * DISPLAY_PW) + (x - minX);
-                *dest = *src;
-            }
-        }
-    /* No scrolling happening, so just copy the latest buffer */
-    } else {
-        memcpy(
-            display.buffer,
-            bgBufferNew.data,
-            DISPLAY_PW * DISPLAY_PH * sizeof(int));
+    fprintf(fp, "{\"scenarios\": [\n");
+    for (int i = 0; i < count; ++i) {
+        const ScenarioResult *r = &results[i];
+        fprintf(fp,
+            "  {\"scenario\": \"%s\", \"frames\": %ld, "
+            "\"mean_ms\": %.4f, \"p99_ms\": %.4f, \"p999_ms\": %.4f, "
+            "\"max_ms\": %.4f, \"allocs\": %lu, "
+            "\"allocs_per_frame\": %.3f}%s\n",
+            r->name, r->frames, r->mean, r->p99, r->p999, r->max,
+            r->allocs, r->allocsPerFrame, i + 1 < count ? "," : "");
     }
+    fprintf(fp, "]}\n");
 }
 
 /*--------------------------------------------------------------------
- * getInput
+ * jsonNumber
  *
- * Call SDL functions to get the state of the keyboard and set
- * appropriate input flags.
+ * Find "key": in a line and return the number after it, or -1.
  *--------------------------------------------------------------------*/
-void getInput()
+double jsonNumber(const char *line, const char *key)
 {
-    SDL_PumpEvents();
-    const Uint8 *state = SDL_GetKeyboardState(NULL);
-    newInput.key_up = state[SDL_SCANCODE_UP];
-    newInput.key_down = state[SDL_SCANCODE_DOWN];
-    newInput.key_left = state[SDL_SCANCODE_LEFT];
-    newInput.key_right = state[SDL_SCANCODE_RIGHT];
-    newInput.key_z = state[SDL_SCANCODE_Z];
-    newInput.key_x = state[SDL_SCANCODE_X];
-    newInput.key_q = state[SDL_SCANCODE_Q];
-    newInput.key_r = state[SDL_SCANCODE_R];
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\":", key);
+    const char *p = strstr(line, quoted);
+    return p ? strtod(p + strlen(quoted), NULL) : -1;
 }
 
 /*--------------------------------------------------------------------
- * updateCamera
+ * checkBaseline
  *
- * When the player comes close to the edge of the screen, scroll the
- * camera's position in the direction corresponding to the edge. Only
- * allow this to happen if the camera is not already scrolling.
- * TODO: I'm still unsure about this movement. It offers a certain
- * aesthetic, but there's the problem of the player disappearing off
- * the screen if they try to go off screen in a different direction
- * during a scroll.
+ * Compare results with a file written earlier by writeScenarioJson.
+ * Report every metric that got worse by more than the threshold
+ * percentage and return the number of them.
  *--------------------------------------------------------------------*/
-void updateCamera()
+int checkBaseline(const char *filename, const ScenarioResult *results,
+    int count, float threshold)
 {
-    if (cam.destTileX == cam.tileX && cam.destTileY == cam.tileY) {
-        int horizEdge = (DISPLAY_TW / 2) - 2;
-        int vertEdge = (DISPLAY_TH / 2) - 2;
-        if (player.x - cam.tileX < -horizEdge) {
-            cam.accelX = -((2 * SCROLL_PW) / pow(0.75, 2));
-            cam.destTileX = cam.tileX - SCROLL_TW;
-            drawMap();
-        } else if (player.x - cam.tileX >= horizEdge) {
-            cam.accelX = (2 * SCROLL_PW) / pow(0.75, 2);
-            cam.destTileX = cam.tileX + SCROLL_TW;
-            drawMap();
-        } else if (player.y - cam.tileY < -vertEdge) {
-            cam.accelY = -((2 * SCROLL_PH) / pow(0.75, 2));
-            cam.destTileY = cam.tileY - SCROLL_TH;
-            drawMap();
-        } else if (player.y - cam.tileY >= vertEdge) {
-            cam.accelY = (2 * SCROLL_PH) / pow(0.75, 2);
-            cam.destTileY = cam.tileY + SCROLL_TH;
-            drawMap();
-        }
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        perror(filename);
+        return 1;
     }
-    if (cam.destTileX != cam.tileX) {
-        if (cam.pixelX > SCROLL_PW / 2
-            || cam.pixelX < -SCROLL_PW / 2) {
-            cam.velocityX -= cam.accelX * dtFrame;
-        } else {
-            cam.velocityX += cam.accelX * dtFrame;
+    static const char *metrics[] = {
+        "mean_ms", "p99_ms", "p999_ms", "allocs_per_frame"
+    };
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        const char *p = strstr(line, "\"scenario\": \"");
+        if (!p) {
+            continue;
         }
-        cam.pixelX += cam.velocityX * dtFrame;
-        if (cam.pixelX >= SCROLL_PW) {
-            cam.velocityX = 0;
-            cam.pixelX = 0;
-            cam.tileX += SCROLL_TW;
-        } else if (cam.pixelX < -SCROLL_PW) {
-            cam.velocityX = 0;
-            cam.pixelX = 0;
-            cam.tileX -= SCROLL_TW;
+        p += strlen("\"scenario\": \"");
+        const ScenarioResult *r = NULL;
+        for (int i = 0; i < count; ++i) {
+            size_t n = strlen(results[i].name);
+            if (strncmp(p, results[i].name, n) == 0 && p[n] == '"') {
+                r = &results[i];
+            }
         }
-    } else if (cam.destTileY != cam.tileY) {
-        if (cam.pixelY > (SCROLL_TH * TILESIZE) / 2
-            || cam.pixelY < -SCROLL_PH / 2) {
-            cam.velocityY -= cam.accelY * dtFrame;
-        } else {
-            cam.velocityY += cam.accelY * dtFrame;
+        if (!r) {
+            continue;
         }
-        cam.pixelY += cam.velocityY * dtFrame;
-        if (cam.pixelY >= SCROLL_PH) {
-            cam.velocityY = 0;
-            cam.pixelY = 0;
-            cam.tileY += SCROLL_TH;
-        } else if (cam.pixelY < -SCROLL_PH) {
-            cam.velocityY = 0;
-            cam.pixelY = 0;
-            cam.tileY -= SCROLL_TH;
+        double current[] = {r->mean, r->p99, r->p999, r->allocsPerFrame};
+        for (int m = 0; m < 4; ++m) {
+            double base = jsonNumber(line, metrics[m]);
+            if (base < 0) {
+                continue;
+            }
+            double limit = base * (1 + threshold / 100);
+            if (current[m] > limit && current[m] - base > 1e-9) {
+                fprintf(stderr, "REGRESSION %s %s: %.4f -> %.4f\n",
+                    r->name, metrics[m], base, current[m]);
+                ++regressions;
+            }
         }
     }
+    fclose(fp);
+    return regressions;
 }
 
 /*--------------------------------------------------------------------
- * updatePlayer
+ * runBenchmarks
  *
- * Handle the movement, rotation, and scaling of the player. Also
- * initialize water ripples.
+ * Run the named scenario, or all of them, print a summary, write the
+ * JSON, and check it against the baseline. Return the exit status.
  *--------------------------------------------------------------------*/
-void updatePlayer()
+int runBenchmarks()
 {
-    /* Calculate the accleration for a distance of one tile in 0.2
-     * seconds, so that the player always moves one tile at a time. */
-    float accel = (2 * TILESIZE) / pow(0.2, 2);
-    /* Only check for input if no movement is currently underway. */
-    if (player.destX == player.x && player.destY == player.y) {
-        if (newInput.key_left) {
-            player.accelX = -accel;
-            player.destX = player.x - 1;
-            player.destAngle = M_PI;
-        }
-        if (newInput.key_right) {
-            player.accelX = accel;
-            player.destX = player.x + 1;
-            player.destAngle = 0.0f;
-        }
-        if (newInput.key_up) {
-            player.accelY = -accel;
-            player.destY = player.y - 1;
-            player.destAngle = M_PI / 2.0f;
-        }
-        if (newInput.key_down) {
-            player.accelY = accel;
-            player.destY = player.y + 1;
-            player.destAngle = (3.0f * M_PI) / 2.0f;
-        }
-/* Test scaling */
-#if 1
-        if (newInput.key_z) {
-            player.scale -= 0.1f;
+    ScenarioResult results[SCENARIO_COUNT];
+    int count = 0;
+    long frames = options.benchFrames;
+    unsigned int seed = options.hasSeed ? options.seed : 1;
+    for (int i = 0; i < SCENARIO_COUNT; ++i) {
+        if (strcmp(options.benchScenario, "all") != 0
+            && strcmp(options.benchScenario, scenarios[i].name) != 0) {
+            continue;
         }
-        if (newInput.key_x) {
-            player.scale += 0.1f;
+        ScenarioResult *r = &results[count++];
+        *r = runScenario(&scenarios[i], frames, seed);
+        if (!r->frames) {
+            return 1;
         }
-#endif
+        fprintf(stderr,
+            "%-10s mean %7.3f ms  p99 %7.3f ms  p99.9 %7.3f ms  "
+            "max %7.3f ms  %.2f allocs/frame\n",
+            r->name, r->mean, r->p99, r->p999, r->max, r->allocsPerFrame);
     }
-    /* If a rotation is incomplete, adjust the player's actual angle
-     * toward its destination. */
-    if (abs((int)player.destAngle - (int)player.angle) > 0) {
-        if (player.destAngle - player.angle >= 0) {
-            player.angle += 0.4f;
-        } else {
-            player.angle -= 0.4f;
-        }
-        if (player.angle > 2 * M_PI) {
-            player.angle = 0.0f;
-        } else if (player.angle < 0.0f) {
-            player.angle = 2 * M_PI;
+    if (count == 0) {
+        fprintf(stderr, "no scenario named '%s'\n", options.benchScenario);
+        return 1;
+    }
+    if (options.benchJson) {
+        FILE *fp = fopen(options.benchJson, "w");
+        if (!fp) {
+            perror(options.benchJson);
+            return 1;
         }
+        writeScenarioJson(fp, results, count);
+        fclose(fp);
     } else {
-        player.angle = player.destAngle;
-    }
-    /* Collision detection against the borders of the tile paths */
-    if (player.destX != player.x &&
-        borderCollide(player.destX, player.y)) {
-        player.destX = player.x;
+        writeScenarioJson(stdout, results, count);
     }
-    if (player.destY != player.y &&
-        borderCollide(player.x, player.destY)) {
-        player.destY = player.y;
+    if (options.baselineFile
+        && checkBaseline(options.baselineFile, results, count,
+            options.threshold) > 0) {
+        return 1;
     }
-    /* Move the player toward the destination set by the input */
-    if (player.destX != player.x) {
-        player.velocityX += player.accelX * dtFrame;
-        player.pixelX += player.velocityX * dtFrame;
-        /* Make the player appear to hop as it moves */
-        player.scale += (fabs(player.velocityX) * 0.005) * dtFrame;
-        /* When the tile move is complete, reset and adjust */
-        if (player.pixelX >= TILESIZE) {
-            player.pixelX = 0;
-            ++player.x;
-            player.velocityX = 0;
-            player.scale = 1.0f;
-            initRipple(player.x, player.y);
-        } else if (player.pixelX < -TILESIZE) {
-            player.pixelX = 0;
-            --player.x;
-            player.velocityX = 0;
-            player.scale = 1.0f;
-            initRipple(player.x, player.y);
+    return 0;
+}
+
+/*--------------------------------------------------------------------
+ * runSoak
+ *
+ * Play the replay over and over, each time from a fresh game, until
+ * the soak time is up. Everything the game keeps for good has been
+ * allocated by the end of the first pass, so if the memory live at
+ * the end of any later pass is more than it was then, something is
+ * leaking. Return the exit status.
+ *--------------------------------------------------------------------*/
+int runSoak(unsigned int seed)
+{
+    unsigned long long start = monotonicNs();
+    unsigned long long end = start + (unsigned long long)(options.soakSeconds * 1e9);
+    size_t baseline[MEM_TAG_COUNT];
+    int failed = 0;
+    long pass;
+    for (pass = 1; !failed && (pass <= 2 || monotonicNs() < end); ++pass) {
+        srand(seed);
+        initGame();
+        drawMap();
+        replay.index = 0;
+        running = 1;
+        long frames = frameCount;
+        while (running) {
+            runFrame();
         }
-    /* TODO: Same as above, abstract this stuff */
-    } else if (player.destY != player.y) {
-        player.velocityY += player.accelY * dtFrame;
-        player.pixelY += player.velocityY * dtFrame;
-        player.scale += (fabs(player.velocityY) * 0.005) * dtFrame;
-        if (player.pixelY >= TILESIZE) {
-            player.pixelY = 0;
-            ++player.y;
-            player.accelX = 0;
-            player.velocityY = 0;
-            player.scale = 1.0f;
-            initRipple(player.x, player.y);
-        } else if (player.pixelY < -TILESIZE) {
-            player.pixelY = 0;
-            --player.y;
-            player.accelX = 0;
-            player.velocityY = 0;
-            player.scale = 1.0f;
-            initRipple(player.x, player.y);
+        arenaReset(&frameArena);
+        printf("pass %ld: %ld frames, %zu bytes live in %lu allocations\n",
+            pass, frameCount - frames, memStats.live,
+            memStats.allocs - memStats.frees);
+        for (int i = 0; i < MEM_TAG_COUNT; ++i) {
+            size_t live = memStats.tags[i].live;
+            if (pass == 1) {
+                baseline[i] = live;
+            } else if (live > baseline[i]) {
+                printf("%s grew from %zu to %zu bytes\n",
+                    memTagNames[i], baseline[i], live);
+                failed = 1;
+            }
         }
     }
+    printf("soak %s after %ld passes in %.1f s\n",
+        failed ? "FAILED" : "passed", pass - 1,
+        (monotonicNs() - start) / 1e9);
+    return failed;
 }
 
 /*--------------------------------------------------------------------
- * processInput
+ * hashDisplay
  *
- * Miscellaneous input handling.
+ * FNV-1a hash of the visible part of the display buffer, so that two
+ * runs of the same recording can be checked for identical output.
  *--------------------------------------------------------------------*/
-void processInput()
+unsigned int hashDisplay()
 {
-    if (newInput.key_q) {
-        running = 0;
-    }
-    if (newInput.key_r && !oldInput.key_r) {
-        initRipple(10, 10);
+    unsigned int hash = 2166136261u;
+    for (int y = 0; y < display.height; ++y) {
+        const unsigned char *row = display.buffer + y * display.strideY;
+        for (int i = 0; i < display.width * display.strideX; ++i) {
+            hash = (hash ^ row[i]) * 16777619u;
+        }
     }
+    return hash;
 }
 
 /*--------------------------------------------------------------------
- * drawPlayer
+ * usage
  *
- * Adjust the player's coordinates so that it is drawn relative to the
- * camera.
+ * Print the command line options.
  *--------------------------------------------------------------------*/
-void drawPlayer()
+void usage(const char *name)
 {
-    int centerX = DISPLAY_TW / 2;
-    int centerY = DISPLAY_TH / 2;
-    int x = (player.x - cam.tileX + centerX) * TILESIZE;
-    int y = (player.y - cam.tileY + centerY) * TILESIZE;
-    int offsetX = player.pixelX - cam.pixelX;
-    int offsetY = player.pixelY - cam.pixelY;
-    drawBitmap(player.bitmap, x + offsetX, y + offsetY, player.angle, player.scale);
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --headless       render offscreen without initializing SDL video\n"
+        "  --frames N       quit after N frames\n"
+        "  --script FILE    take input from an input script\n"
+        "  --seed N         seed the map generator with N\n"
+        "  --record FILE    record the seed and every step's input\n"
+        "  --replay FILE    play back a recording\n"
+        "  --uncapped       don't wait for the frame timer\n"
+        "  --vsync          let the display's vertical sync pace frames\n"
+        "  --fps HZ         render at this rate (default: the display's)\n"
+        "  --tick-rate HZ   simulate at this rate, 30 to 1000 (default 60)\n"
+        "  --sim-only       headless, and only run the simulation\n"
+        "  --no-idle        keep rendering when nothing is happening\n"
+        "  --no-reload      don't reload assets when their files change\n"
+        "  --fish N         put N fish in the water\n"
+        "  --bench NAME     run a benchmark scenario headless, or 'all' of them:\n"
+        "                   idle, scroll, swim, whale, largemap, school\n"
+        "  --bench-frames N frames to time per scenario (default 1200)\n"
+        "  --bench-json FILE write the results here instead of stdout\n"
+        "  --baseline FILE  fail if results are worse than these\n"
+        "  --threshold PCT  allowed regression from the baseline (default 10)\n"
+        "  --soak SECONDS   loop a replay headless, and fail if memory grows\n",
+        name);
+#ifdef KUJIRA_PROFILE
+    fprintf(stderr,
+        "  --profile        print per-stage timings on exit\n"
+        "  --overlay        start with the timing overlay on (F3 toggles)\n"
+        "  --trace FILE     write a Chrome trace of every frame\n");
+#endif
+}
+
+/*--------------------------------------------------------------------
+ * parseArgs
+ *
+ * Fill in the global options from the command line. Return 0 if the
+ * command line is bad.
+ *--------------------------------------------------------------------*/
+int parseArgs(int argc, char **argv)
+{
+    options.threshold = 10;
+    options.benchFrames = 1200;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        int hasValue = i + 1 < argc;
+        if (strcmp(arg, "--headless") == 0) {
+            options.headless = 1;
+        } else if (strcmp(arg, "--frames") == 0 && hasValue) {
+            options.frameLimit = atol(argv[++i]);
+        } else if (strcmp(arg, "--script") == 0 && hasValue) {
+            options.scriptFile = argv[++i];
+        } else if (strcmp(arg, "--seed") == 0 && hasValue) {
+            options.seed = strtoul(argv[++i], NULL, 0);
+            options.hasSeed = 1;
+        } else if (strcmp(arg, "--record") == 0 && hasValue) {
+            options.recordFile = argv[++i];
+        } else if (strcmp(arg, "--replay") == 0 && hasValue) {
+            options.replayFile = argv[++i];
+        } else if (strcmp(arg, "--uncapped") == 0) {
+            options.uncapped = 1;
+        } else if (strcmp(arg, "--vsync") == 0) {
+            pacer.vsync = 1;
+        } else if (strcmp(arg, "--fps") == 0 && hasValue) {
+            options.renderRate = atoi(argv[++i]);
+        } else if (strcmp(arg, "--tick-rate") == 0 && hasValue) {
+            options.tickRate = atof(argv[++i]);
+        } else if (strcmp(arg, "--no-idle") == 0) {
+            options.noIdle = 1;
+        } else if (strcmp(arg, "--no-reload") == 0) {
+            options.noReload = 1;
+        } else if (strcmp(arg, "--fish") == 0 && hasValue) {
+            options.fish = atoi(argv[++i]);
+        } else if (strcmp(arg, "--sim-only") == 0) {
+            options.simOnly = 1;
+            options.headless = 1;
+        } else if (strcmp(arg, "--bench") == 0 && hasValue) {
+            options.benchScenario = argv[++i];
+            options.headless = 1;
+        } else if (strcmp(arg, "--bench-frames") == 0 && hasValue) {
+            options.benchFrames = atol(argv[++i]);
+        } else if (strcmp(arg, "--bench-json") == 0 && hasValue) {
+            options.benchJson = argv[++i];
+        } else if (strcmp(arg, "--baseline") == 0 && hasValue) {
+            options.baselineFile = argv[++i];
+        } else if (strcmp(arg, "--threshold") == 0 && hasValue) {
+            options.threshold = atof(argv[++i]);
+        } else if (strcmp(arg, "--soak") == 0 && hasValue) {
+            options.soakSeconds = atof(argv[++i]);
+            options.headless = 1;
+#ifdef KUJIRA_PROFILE
+        } else if (strcmp(arg, "--profile") == 0) {
+            profiler.report = 1;
+        } else if (strcmp(arg, "--overlay") == 0) {
+            profiler.overlay = 1;
+        } else if (strcmp(arg, "--trace") == 0 && hasValue) {
+            options.traceFile = argv[++i];
+#endif
+        } else {
+            return 0;
+        }
+    }
+    if (options.soakSeconds && (!options.replayFile || options.recordFile)) {
+        fprintf(stderr, "--soak needs --replay, and can't --record\n");
+        return 0;
+    }
+    /* Without a keyboard, something else has to end the run */
+    if (options.headless && !options.frameLimit && !options.scriptFile
+        && !options.replayFile && !options.benchScenario) {
+        fprintf(stderr, "--headless needs --frames, --script or --replay\n");
+        return 0;
+    }
+    if (options.headless) {
+        options.uncapped = 1;
+    }
+    if (options.tickRate < 0 || options.renderRate < 0) {
+        fprintf(stderr, "rates must be positive\n");
+        return 0;
+    }
+    if (options.tickRate && (options.tickRate < MIN_TICK_RATE
+        || options.tickRate > MAX_TICK_RATE)) {
+        fprintf(stderr, "--tick-rate must be from %g to %g\n",
+            MIN_TICK_RATE, MAX_TICK_RATE);
+        return 0;
+    }
+    if (options.fish < 0) {
+        fprintf(stderr, "--fish must be positive\n");
+        return 0;
+    }
+    if (options.benchFrames < 1) {
+        fprintf(stderr, "--bench-frames must be at least 1\n");
+        return 0;
+    }
+    return 1;
 }
 
+/* Tools that link against the game's code, like the benchmarks,
+ * define KUJIRA_NO_MAIN and include this file. */
+#ifndef KUJIRA_NO_MAIN
 /*--------------------------------------------------------------------
  * main
  *
  * Initialization of objects, main loop, and frame timer.
  *--------------------------------------------------------------------*/
-int main()
+int main(int argc, char **argv)
 {
-    srand(time(NULL));
-    dtFrame = 1.0f / 60.0f;
-    cam.tileX = 0;
-    cam.tileY = 0;
-    cam.destTileX = 0;
-    cam.destTileY = 0;
-    cam.pixelX = 0;
-    cam.pixelY = 0;
-    cam.velocityX = 0;
-    cam.velocityY = 0;
-    player.x = 0;
-    player.y = 0;
-    player.destX = 0;
-    player.destY = 0;
-    player.velocityX = 0;
-    player.velocityY = 0;
-    player.accelX = 0;
-    player.accelY = 0;
-    player.angle = 0.0f;
-    player.oldDirection = 1;
-    player.newDirection = 1;
-    player.bitmap = loadBitmap("assets/whale.bmp");
-    player.scale = 1.0f;
-    player.destScale = 1.0f;
-    initMap();
-    initDisplay();
-    bgBufferOld.width = display.width;
-    bgBufferOld.height = display.height;
-    int dataLen = bgBufferOld.width * bgBufferOld.height;
-    bgBufferOld.data = (unsigned int *)calloc(dataLen, sizeof(int));
-    bgBufferNew.width = display.width;
-    bgBufferNew.height = display.height;
-    bgBufferNew.data = (unsigned int *)calloc(dataLen, sizeof(int));
+    initMath();
+    if (!parseArgs(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.scriptFile && !loadScript(options.scriptFile)) {
+        return 1;
+    }
+    unsigned int seed = options.hasSeed ? options.seed : time(NULL);
+    dtFrame = 1.0f / (options.tickRate ? options.tickRate : BASE_TICK_RATE);
+    /* A replay brings its own seed and frame time */
+    if (options.replayFile
+        && !loadReplay(options.replayFile, &seed, &dtFrame)) {
+        return 1;
+    }
+    if (options.recordFile && !startRecording(options.recordFile, seed)) {
+        return 1;
+    }
+    srand(seed);
+#ifdef KUJIRA_PROFILE
+    if (options.traceFile && !traceStart(options.traceFile)) {
+        return 1;
+    }
+#endif
+    /* Assets come from the packed archive if it has them. Recordings
+     * and scripts should look the same every time they're played, so
+     * only a window taking live input gets reloaded assets. */
+    openArchive("assets/kujira.pak");
+    if (!startResources(!options.headless && !options.noReload
+        && !options.replayFile && !options.scriptFile)) {
+        return 1;
+    }
+    player.sprite = acquireBitmap("assets/whale.bmp");
+    /* Without a fish of their own, the fish are little whales */
+    entities.sprite = acquireBitmap(access("assets/fish.bmp", R_OK) == 0
+        ? "assets/fish.bmp" : "assets/whale.bmp");
+    entities.spriteScale = FISH_SCALE;
+    if (!waitForResources()) {
+        return 1;
+    }
+    initDisplay(options.headless ? &headlessBackend : &sdlBackend);
+    initBackground();
+    scheduler.lockstep = options.headless || options.replayFile;
+    /* Idling only makes sense when frames are paced in real time, and
+     * when they're waiting on live input rather than playing back a
+     * replay, script or scenario, which sends no events to wake them */
+    idle.enabled = !options.noIdle && !options.headless && !options.uncapped
+        && !options.replayFile && !options.scriptFile
+        && !options.benchScenario;
+    if (options.benchScenario || options.soakSeconds) {
+        int status = options.benchScenario ? runBenchmarks() : runSoak(seed);
+        releaseResource(player.sprite);
+        releaseResource(entities.sprite);
+        stopResources();
+        return status;
+    }
+    initGame();
     drawMap();
-    struct timespec starttime, endtime;
     const int oneBillion = 1000000000;
-    int targettime = dtFrame * oneBillion; /* nanoseconds */
-    clock_gettime(CLOCK_REALTIME, &starttime);
+    unsigned long long runStart = monotonicNs();
+    initPacer();
     while (running) {
-        getInput();
-        processInput();
-        updatePlayer();
-        updateCamera();
-        drawBackground();
-        animateRipple();
-        drawPlayer();
-        blitDisplay();
-        oldInput = newInput;
-        clock_gettime(CLOCK_REALTIME, &endtime);
-        int difftime = endtime.tv_nsec - starttime.tv_nsec;
-        if (difftime < 0) {
-            difftime += oneBillion; /* add bias */
-        }
-        if (difftime < targettime) {
-            usleep((targettime - difftime) / 1000); /* microseconds */
-        }
-#if 0
-        printf("\nBEFORE SLEEP: %f\n", difftime / (float)oneBillion);
-        clock_gettime(CLOCK_REALTIME, &endtime);
-        difftime = endtime.tv_nsec - starttime.tv_nsec;
-        if (difftime < 0) {
-            difftime += 1000000000;
-        }
-        printf("AFTER SLEEP:  %f\n", difftime / (float)oneBillion);
+        runFrame();
+        if (options.frameLimit && frameCount >= options.frameLimit) {
+            running = 0;
+        }
+        if (idle.resting) {
+            idleWait();
+        } else if (!options.uncapped) {
+            pacerWait();
+        }
+    }
+    if (replay.recordFile) {
+        fclose(replay.recordFile);
+    }
+    releaseResource(player.sprite);
+    releaseResource(entities.sprite);
+    stopResources();
+#ifdef KUJIRA_PROFILE
+    traceStop();
+    if (profiler.report) {
+        profileReport(stdout);
+    }
 #endif
-        clock_gettime(CLOCK_REALTIME, &starttime);
+    if (options.simOnly) {
+        double seconds = (monotonicNs() - runStart) / (double)oneBillion;
+        printf("%ld steps in %.3f s (%.1f steps/s), player at %d,%d\n",
+            stepCount, seconds, stepCount / seconds, player.x, player.y);
+    } else if (options.headless) {
+        double seconds = (monotonicNs() - runStart) / (double)oneBillion;
+        printf("%ld frames in %.3f s (%.1f fps), last frame %08x\n",
+            frameCount, seconds, frameCount / seconds, hashDisplay());
     }
     return 0;
 }
+#endif
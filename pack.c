@@ -0,0 +1,181 @@
+/*--------------------------------------------------------------------
+ * Kujira: asset packer
+ *
+ * Copyright 2020 Sean Tommasi
+ *--------------------------------------------------------------------*/
+#define KUJIRA_NO_MAIN
+#include "main.c"
+
+#define PACK_MAX_ASSETS 64
+
+/* An image on its way into the archive */
+typedef struct packImage {
+    Bitmap bitmap;
+    ArchiveImage *record;
+} PackImage;
+
+/*--------------------------------------------------------------------
+ * alignUp
+ *
+ * Round an archive offset up to the bitmap alignment.
+ *--------------------------------------------------------------------*/
+unsigned int alignUp(unsigned int offset)
+{
+    return (offset + BITMAP_ALIGN - 1) / BITMAP_ALIGN * BITMAP_ALIGN;
+}
+
+/*--------------------------------------------------------------------
+ * measureImage
+ *
+ * Fill in an image's dimensions and the bounding box of its pixels
+ * that aren't transparent. An image with none has an empty box.
+ *--------------------------------------------------------------------*/
+void measureImage(Bitmap bitmap, ArchiveImage *record)
+{
+    record->width = bitmap.width;
+    record->height = bitmap.height;
+    record->stride = bitmap.stride;
+    int minX = bitmap.width, minY = bitmap.height, maxX = -1, maxY = -1;
+    for (int y = 0; y < bitmap.height; ++y) {
+        for (int x = 0; x < bitmap.width; ++x) {
+            if (bitmap.data[y * bitmap.stride + x] & ENGINE_AMASK) {
+                if (x < minX) minX = x;
+                if (x > maxX) maxX = x;
+                if (y < minY) minY = y;
+                if (y > maxY) maxY = y;
+            }
+        }
+    }
+    if (maxX < 0) {
+        minX = minY = 0;
+        maxX = maxY = -1;
+    }
+    record->boxX = minX;
+    record->boxY = minY;
+    record->boxW = maxX - minX + 1;
+    record->boxH = maxY - minY + 1;
+}
+
+/*--------------------------------------------------------------------
+ * renderPose
+ *
+ * Render a bitmap facing one way at a scale of 1, exactly as
+ * drawBitmap would, and keep it past the end of the frame.
+ *--------------------------------------------------------------------*/
+Bitmap renderPose(Bitmap bitmap, float angle)
+{
+    arenaReset(&frameArena);
+    Bitmap scaledBitmap = scaleBitmap(bitmap, NULL, 1.0f);
+    Bitmap rotatedBitmap = rotateBitmap(scaledBitmap, angle);
+    if (fabs(angle - M_PI) < 0.1f) {
+        rotatedBitmap = vflipBitmap(rotatedBitmap);
+    }
+    Bitmap pose = newBitmap(rotatedBitmap.width, rotatedBitmap.height,
+        MEM_ASSETS);
+    memcpy(pose.data, rotatedBitmap.data,
+        pose.stride * pose.height * sizeof(int));
+    return pose;
+}
+
+/*--------------------------------------------------------------------
+ * writeImage
+ *
+ * Write an image's pixels at its offset, then its silhouette mask.
+ *--------------------------------------------------------------------*/
+void writeImage(FILE *fp, const PackImage *image)
+{
+    Bitmap bitmap = image->bitmap;
+    fseek(fp, image->record->offset, SEEK_SET);
+    fwrite(bitmap.data, sizeof(int), bitmap.stride * bitmap.height, fp);
+    int maskStride = (bitmap.width + 7) / 8;
+    unsigned char *row = memAlloc(maskStride, MEM_OTHER);
+    for (int y = 0; y < bitmap.height; ++y) {
+        memset(row, 0, maskStride);
+        for (int x = 0; x < bitmap.width; ++x) {
+            if (bitmap.data[y * bitmap.stride + x] & ENGINE_AMASK) {
+                row[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        fwrite(row, 1, maskStride, fp);
+    }
+    memFree(row);
+}
+
+/*--------------------------------------------------------------------
+ * main
+ *
+ * Load each BMP, named in the archive after its file without the
+ * directory or extension, prerender its poses, lay everything out
+ * aligned after the table, and write the archive.
+ *--------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc - 2 > PACK_MAX_ASSETS) {
+        fprintf(stderr, "usage: %s ARCHIVE FILE.bmp...\n", argv[0]);
+        return 1;
+    }
+    int count = argc - 2;
+    initMath();
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 4);
+    header.version = ARCHIVE_VERSION;
+    header.count = count;
+    ArchiveEntry entries[PACK_MAX_ASSETS];
+    PackImage images[PACK_MAX_ASSETS * (1 + POSE_COUNT)];
+    int imageCount = 0;
+    memset(entries, 0, sizeof(entries));
+    unsigned int offset = alignUp(sizeof(header) + count * sizeof(ArchiveEntry));
+    for (int i = 0; i < count; ++i) {
+        const char *path = argv[i + 2];
+        const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        size_t length = strcspn(base, ".");
+        if (length == 0 || length >= ARCHIVE_NAME_SIZE) {
+            fprintf(stderr, "%s: name must be 1 to %d characters\n", path,
+                ARCHIVE_NAME_SIZE - 1);
+            return 1;
+        }
+        memcpy(entries[i].name, base, length);
+        Bitmap bitmap = loadBitmap(path);
+        if (!bitmap.data) {
+            return 1;
+        }
+        images[imageCount].bitmap = bitmap;
+        images[imageCount++].record = &entries[i].image;
+        for (int j = 0; j < POSE_COUNT; ++j) {
+            images[imageCount].bitmap = renderPose(bitmap, poseAngles[j]);
+            images[imageCount++].record = &entries[i].poses[j];
+        }
+    }
+    for (int i = 0; i < imageCount; ++i) {
+        ArchiveImage *record = images[i].record;
+        measureImage(images[i].bitmap, record);
+        record->offset = offset;
+        record->maskOffset = offset + record->stride * record->height * sizeof(int);
+        offset = alignUp(record->maskOffset + (record->width + 7) / 8 * record->height);
+    }
+    FILE *fp = fopen(argv[1], "wb");
+    if (!fp) {
+        perror(argv[1]);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(entries, sizeof(ArchiveEntry), count, fp);
+    for (int i = 0; i < imageCount; ++i) {
+        writeImage(fp, &images[i]);
+    }
+    /* Pad the end, so the last image is followed by a whole block */
+    fseek(fp, offset - 1, SEEK_SET);
+    fputc(0, fp);
+    if (fclose(fp) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+        const ArchiveImage *image = &entries[i].image;
+        printf("%-16s %dx%d, box %d,%d %dx%d, %d poses\n", entries[i].name,
+            image->width, image->height, image->boxX, image->boxY,
+            image->boxW, image->boxH, POSE_COUNT);
+    }
+    return 0;
+}